@@ -48,6 +48,39 @@
 #define BOARD_FLASH_SCK_PIN      PIN_PA11
 #define BOARD_FLASH_CS_PIN       PIN_PA09
 
+// Hardware SPI for the flash; remove BOARD_FLASH_SERCOM to fall back to bit-banging
+#define BOARD_FLASH_SERCOM       SERCOM0
+#define BOARD_FLASH_MOSI_PINMUX  PINMUX_PA08C_SERCOM0_PAD0
+#define BOARD_FLASH_MISO_PINMUX  PINMUX_PA10C_SERCOM0_PAD2
+#define BOARD_FLASH_SCK_PINMUX   PINMUX_PA11C_SERCOM0_PAD3
+#define BOARD_FLASH_DOPO         3 // MOSI on PAD0, SCK on PAD3
+#define BOARD_FLASH_DIPO         2 // MISO on PAD2
+#define BOARD_FLASH_BAUDRATE     24000000
+#define BOARD_FLASH_CACHE_SECTORS 8
+
+// FPGA configuration port; SPI_SS shares the flash CS, as usual for iCE40
+#define BOARD_FPGA_CRESET_PIN    PIN_PA02
+#define BOARD_FPGA_CDONE_PIN     PIN_PA03
+// lets the EIC timestamp CDONE; without it, CDONE is only polled
+#define BOARD_FPGA_CDONE_EXTINT  3
+#define BOARD_FPGA_CDONE_PINMUX  PINMUX_PA03A_EIC_EXTINT3
+#define BOARD_FPGA_CS_PIN        BOARD_FLASH_CS_PIN
+// chip select of the register interface in the FPGA user logic
+#define BOARD_FPGA_REG_CS_PIN    PIN_PA04
+
+// JTAG header, for FPGAs that aren't configured over SPI; TDI/TCK/TDO sit on
+// SERCOM1, so long scans are shifted by the SERCOM
+#define BOARD_JTAG_TDI_PIN       PIN_PA16
+#define BOARD_JTAG_TCK_PIN       PIN_PA17
+#define BOARD_JTAG_TDO_PIN       PIN_PA18
+#define BOARD_JTAG_TMS_PIN       PIN_PA19
+#define BOARD_JTAG_SERCOM        SERCOM1
+#define BOARD_JTAG_TDI_PINMUX    PINMUX_PA16C_SERCOM1_PAD0
+#define BOARD_JTAG_TCK_PINMUX    PINMUX_PA17C_SERCOM1_PAD1
+#define BOARD_JTAG_TDO_PINMUX    PINMUX_PA18C_SERCOM1_PAD2
+#define BOARD_JTAG_DOPO          0 // TDI on PAD0, TCK on PAD1
+#define BOARD_JTAG_DIPO          2 // TDO on PAD2
+
 #define BOARD_VUSB_PIN           PIN_PA28
 
 #endif
@@ -40,6 +40,8 @@
 #define USB_EP_MSC_OUT 5
 
 #define USB_EP_HID 6
+// FPGA register interface; takes the HID endpoint, which it can't be used with
+#define USB_EP_FPGA 6
 #define USB_EP_WEB 7
 
 #define MAX_EP 8
@@ -130,11 +132,40 @@ typedef struct {
     uint8_t buf[PKT_SIZE];
 } PacketBuffer __attribute__((aligned(4)));
 
+// MULTI_PACKET_SIZE is a 14 bit field
+#define USB_MULTI_PACKET_MAX 0x3fc0
+
 uint32_t USB_Read(void *pData, uint32_t length, uint32_t ep);
 uint32_t USB_Write(const void *pData, uint32_t length, uint8_t ep_num);
 uint32_t USB_WriteCore(const void *pData, uint32_t length, uint8_t ep_num, bool handoverMode);
+// Non-blocking IN: USB_WriteSubmit() starts sending pData, which must be in RAM
+// and stay untouched until USB_WriteDone() says the host has taken it.
+// USB_WriteWait() returns false if a bus reset dropped the transfer.
+void USB_WriteSubmit(const void *pData, uint32_t length, uint8_t ep_num);
+bool USB_WriteDone(uint8_t ep_num);
+bool USB_WriteWait(uint8_t ep_num);
 void USB_ReadBlocking(void *dst, uint32_t length, uint32_t ep, PacketBuffer *cache);
 uint32_t USB_ReadCore(void *pData, uint32_t length, uint32_t ep, PacketBuffer *cache);
+// Receive length bytes into dst in one go; dst must be word aligned and length
+// a multiple of the packet size, or it falls back to USB_ReadBlocking().
+// Returns the bytes received, less on a short packet or 0 on a bus reset.
+uint32_t USB_ReadMulti(void *dst, uint32_t length, uint32_t ep);
 bool USB_Ok(void);
 
+// Posted by USB_Handler() for the main loop
+enum {
+    USB_EVENT_RESET = 1,
+    USB_EVENT_CONFIGURED,
+    USB_EVENT_OUT,      // a packet came in on `ep`
+    USB_EVENT_OVERFLOW, // the queue was full and events were lost
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t ep;
+} USB_Event;
+
+bool usb_get_event(USB_Event *ev);
+bool usb_event_pending(void);
+
 #endif // CDC_ENUMERATE_H
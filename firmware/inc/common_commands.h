@@ -28,8 +28,12 @@
 
 #define CMD_READ_JEDEC_ID 0x9f
 #define CMD_READ_DATA 0x03
+#define CMD_FAST_READ 0x0b
+#define CMD_READ_SFDP 0x5a
 #define CMD_SECTOR_ERASE 0x20
 // #define CMD_SECTOR_ERASE CMD_READ_JEDEC_ID
+#define CMD_BLOCK_ERASE_32K 0x52
+#define CMD_BLOCK_ERASE_64K 0xd8
 #define CMD_DISABLE_WRITE 0x04
 #define CMD_ENABLE_WRITE 0x06
 #define CMD_PAGE_PROGRAM 0x02
@@ -23,13 +23,19 @@
  */
 
 /*
- * Bit-banging SPI Driver
+ * SPI master driver for the external flash
+ *
+ * Boards that define BOARD_FLASH_SERCOM (plus the matching pinmux/pad
+ * settings, see boards/fpga_helper/board_config.h) use the SERCOM in SPI
+ * master mode. Boards without it fall back to bit-banging the
+ * BOARD_FLASH_*_PIN pins.
  */
 
 #ifndef SPI_DRIVER_H
 #define SPI_DRIVER_H
 
-
+#include <stdbool.h>
+#include <stdint.h>
 
 /** \brief Transfer descriptor for SPI
  *  Transfer descriptor holds TX and RX buffers
@@ -43,18 +49,91 @@ struct spi_xfer {
 	uint32_t size;
 };
 
+/** \brief Configure the SPI pins and peripheral
+ *
+ *  Must be called after system_init(), as the SERCOM is clocked from GCLK0.
+ *  The initial clock rate is BOARD_FLASH_BAUDRATE.
+ */
+void spi_m_sync_init(void);
+
+/** \brief Tristate MOSI and SCK, so another master (the FPGA) can use the bus */
+void spi_m_sync_release(void);
+
+/** \brief Drive MOSI and SCK again after spi_m_sync_release() */
+void spi_m_sync_acquire(void);
+
+/** \brief Set the SPI clock rate
+ *
+ *  The rate is rounded down to the nearest one the SERCOM can generate.
+ *  Has no effect on the bit-banged driver.
+ *
+ *  \param[in] baudrate Requested SCK frequency in Hz.
+ *
+ *  \return The SCK frequency actually used.
+ */
+uint32_t spi_m_sync_set_baudrate(uint32_t baudrate);
 
 /** \brief Perform the SPI data transfer (TX and RX) in polling way
  *
- *  Activate CS, do TX and RX and deactivate CS. It blocks.
+ *  Does not touch CS; the caller selects the device. It blocks, first until
+ *  a transfer started by spi_m_dma_transfer() is done.
  *
- *  \param[in, out] spi Pointer to the HAL SPI instance.
  *  \param[in] xfer Pointer to the transfer information (\ref spi_xfer).
+ *                  A NULL txbuf sends 0xFF, a NULL rxbuf discards input.
  *
  *  \retval size Success.
  *  \retval >=0 Timeout, with number of characters transferred.
- *  \retval ERR_BUSY SPI is busy
  */
-int32_t spi_m_sync_transfer(struct spi_m_sync_descriptor *spi, const struct spi_xfer *xfer);
+int32_t spi_m_sync_transfer(const struct spi_xfer *xfer);
+
+typedef void (*spi_dma_callback_t)(void);
+
+/** Largest phase of spi_m_dma_transfer(); the DMAC block count is 16 bits */
+#define SPI_DMA_MAX_SIZE 0xffff
+
+/** \brief Perform a two-phase SPI transfer using the DMAC
+ *
+ *  The header (command/address) and data phases are chained as linked DMA
+ *  descriptors, so the whole transaction runs without the CPU. Returns as
+ *  soon as the transfer is started; \p done is called from the DMAC
+ *  interrupt once the last byte has been clocked in. Like
+ *  spi_m_sync_transfer() it does not touch CS.
+ *
+ *  The buffers must stay valid until \p done is called. On boards without
+ *  a SERCOM the transfer is done synchronously before returning.
+ *
+ *  \param[in] header First phase, normally the command and address bytes.
+ *  \param[in] data Second phase, may be NULL or have size 0.
+ *  \param[in] done Completion callback, may be NULL.
+ *
+ *  \retval false A phase is larger than SPI_DMA_MAX_SIZE; nothing was started.
+ */
+bool spi_m_dma_transfer(const struct spi_xfer *header, const struct spi_xfer *data,
+                        spi_dma_callback_t done);
+
+/** \brief Check if a transfer started by spi_m_dma_transfer() is still running */
+bool spi_m_dma_busy(void);
+
+/** \brief Wait until spi_m_dma_transfer() is done with the bus
+ *
+ *  The devices on the bus share MISO and the clock, so this has to come
+ *  before any chip select goes low.
+ */
+void spi_m_dma_wait(void);
+
+/** \brief Compute a CRC32 over the bytes received by DMA
+ *
+ *  While enabled, the DMAC CRC engine computes the CRC-32 (IEEE 802.3) of
+ *  everything the RX channel of spi_m_dma_transfer() receives.
+ *
+ *  \retval false No hardware CRC (bit-banged driver); compute it in software.
+ */
+bool spi_m_dma_crc32_start(void);
+
+/** \brief Stop the CRC engine
+ *
+ *  \return The final CRC-32 of the received bytes.
+ */
+uint32_t spi_m_dma_crc32_end(void);
 
-#endif // _SPI_DRIVER_H_
\ No newline at end of file
+#endif // _SPI_DRIVER_H_
@@ -42,4 +42,39 @@ bool spi_flash_read_data(uint32_t address, uint8_t* data, uint32_t data_length);
 void spi_flash_init(void);
 void spi_flash_init_device(const external_flash_device* device);
 
+// Match the JEDEC ID against devices.h, falling back to SFDP for unknown parts.
+// Returns NULL if no flash answers.
+const external_flash_device* spi_flash_detect(void);
+// Descriptor passed to spi_flash_init_device(), or NULL.
+const external_flash_device* spi_flash_device(void);
+// Size of the detected part in bytes, 0 if none was found.
+uint32_t spi_flash_size(void);
+
+// Page program operations must not cross a page boundary.
+#define SPI_FLASH_PAGE_SIZE 256
+// Smallest erase unit (CMD_SECTOR_ERASE)
+#define SPI_FLASH_SECTOR_SIZE 4096
+
+// CRC-32 (as computed by zlib) of a flash range, using the DMAC CRC engine if available.
+uint32_t spi_flash_crc32(uint32_t address, uint32_t length);
+
+// Check the write in progress bit (or a pending DMA transfer) without blocking.
+bool spi_flash_is_busy(void);
+// Poll the status register until the write in progress bit clears.
+void spi_flash_wait_ready(void);
+
+// Asynchronous, DMA driven variants of the data calls. They return as soon as the
+// transfer is started; `done` (may be NULL) is called from interrupt context once
+// CS has been released. Write data of up to one page is copied, so the caller's
+// buffer can be reused right away; the read buffer must stay valid until `done`.
+// Reads are limited to SPI_DMA_MAX_SIZE bytes; both return false if too long.
+// All of the synchronous calls above wait for a pending transfer first.
+typedef void (*spi_flash_callback_t)(void);
+bool spi_flash_write_data_async(uint32_t address, uint8_t* data, uint32_t data_length,
+                                spi_flash_callback_t done);
+bool spi_flash_read_data_async(uint32_t address, uint8_t* data, uint32_t data_length,
+                               spi_flash_callback_t done);
+bool spi_flash_async_busy(void);
+void spi_flash_async_wait(void);
+
 #endif  // MICROPY_INCLUDED_ATMEL_SAMD_SPI_FLASH_H
@@ -12,6 +12,7 @@
 #include "sam_ba_monitor.h"
 #include "usart_sam_ba.h"
 #include "spi_flash_api.h"
+#include "spi_driver.h"
 #include "common_commands.h"
 #include <stdio.h>
 #include <string.h>
@@ -29,12 +30,233 @@
 #define USB_PID 0x2402 // Generic HID device
 #endif
 
+// SCK rate for the external flash; lowered further to the part's limit once it is identified
+#ifndef BOARD_FLASH_BAUDRATE
+#define BOARD_FLASH_BAUDRATE 1000000
+#endif
+
 #ifndef INDEX_URL
 #define INDEX_URL "https://www.pxt.io/"
 #endif
 
 #include "uf2_version.h"
 
+#ifdef BOARD_FLASH_CS_PIN
+// UF2 blocks are routed to the external SPI flash (holding the FPGA bitstream) when they
+// carry this family ID, in which case targetAddr is the offset into the SPI flash, or
+// when their targetAddr falls into the window at SPI_FLASH_UF2_BASE.
+#ifndef SPI_FLASH_FAMILY_ID
+#define SPI_FLASH_FAMILY_ID 0x7a2f4c1bUL // Randomly selected
+#endif
+#define SPI_FLASH_UF2_BASE 0x10000000
+// Largest external flash we track writes for; limits the UF2 address window
+#ifndef SPI_FLASH_MAX_SIZE
+#define SPI_FLASH_MAX_SIZE (1 << 21)
+#endif
+// Number of 512 byte flash sectors cached in RAM for reads
+#ifndef BOARD_FLASH_CACHE_SECTORS
+#define BOARD_FLASH_CACHE_SECTORS 4
+#endif
+#endif
+
+#ifdef BOARD_FPGA_CRESET_PIN
+// UF2 files with this family ID are clocked straight into the FPGA's slave SPI
+// configuration port instead of being stored; the payload is the raw bitstream.
+#ifndef FPGA_STREAM_FAMILY_ID
+#define FPGA_STREAM_FAMILY_ID 0x3d9e0a57UL // Randomly selected
+#endif
+// Blocks with this family ID carry an FPGA_Control command instead of data.
+#ifndef FPGA_CONTROL_FAMILY_ID
+#define FPGA_CONTROL_FAMILY_ID 0x5c41e7a2UL // Randomly selected
+#endif
+
+// Bitstream slots in the external flash. Each slot starts with a header page
+// (FPGA_SlotHeader), followed by the bitstream. The sector at FPGA_BOOT_HEADER_ADDR
+// holds the iCE40 multi-boot header pointing the FPGA at the active slot.
+#define FPGA_BOOT_HEADER_ADDR 0
+#ifndef FPGA_SLOT_BASE
+#define FPGA_SLOT_BASE 0x10000
+#endif
+#ifndef FPGA_SLOT_SIZE
+#define FPGA_SLOT_SIZE 0x40000
+#endif
+#ifndef FPGA_NUM_SLOTS
+#define FPGA_NUM_SLOTS 4
+#endif
+#define FPGA_SLOT_HEADER_SIZE 256
+#define FPGA_SLOT_MAGIC 0x544f4c53UL // "SLOT"
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t length; // of the bitstream
+    uint32_t crc32;  // ditto
+} FPGA_SlotHeader;
+
+// Store the header (with the CRC of `length` bytes of bitstream) of a freshly written slot;
+// length 0 takes the upload that just ended, without its padding
+#define FPGA_CTRL_COMMIT 1
+// Point the boot header at the slot (after checking its CRC) and reconfigure the FPGA
+#define FPGA_CTRL_SELECT 2
+
+typedef struct {
+    uint32_t command;
+    uint32_t slot;
+    uint32_t length;
+    uint32_t version;
+} FPGA_Control;
+
+// Configurations watched by the supervisor in fpga.c, timed from the release of
+// CRESET to the rising edge of CDONE
+#define FPGA_CONFIG_HISTORY 8
+
+#define FPGA_CONFIG_POWER_ON 1 // loaded itself at power-up; timed from our own reset
+#define FPGA_CONFIG_FLASH 2    // CRESET pulse, loading the active slot
+#define FPGA_CONFIG_STREAM 3   // FPGA_STREAM_FAMILY_ID blocks over slave SPI
+
+typedef struct {
+    uint8_t source;
+    uint8_t done; // CDONE went high; otherwise we gave up
+    uint16_t reserved;
+    uint32_t time_ms;     // since boot, when CRESET was released
+    uint32_t duration_us; // until CDONE went high, or until we gave up
+    uint32_t bytes;       // clocked in by us; streams only
+} FPGA_ConfigRecord;
+
+typedef struct {
+    uint32_t configs;
+    uint32_t failures;
+    // of the successful ones
+    uint32_t last_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t total_us;
+    uint32_t pending; // a configuration is still waiting for CDONE
+    uint32_t cdone;   // current level
+    uint32_t num_records;
+    FPGA_ConfigRecord records[FPGA_CONFIG_HISTORY]; // most recent first
+} FPGA_ConfigStats;
+
+#ifdef BOARD_JTAG_TCK_PIN
+// UF2 files with this family ID hold an XSVF file, played on the JTAG header
+#ifndef JTAG_XSVF_FAMILY_ID
+#define JTAG_XSVF_FAMILY_ID 0x6b1e93c4UL // Randomly selected
+#endif
+#endif
+
+// Register transactions with the FPGA user logic on the vendor bulk interface.
+// The host sends an FPGA_RegList followed by `size` bytes of FPGA_RegOp entries,
+// each write followed by its data and each poll by an FPGA_RegPoll. The reply is
+// an FPGA_RegReply followed by the data of all reads and polls, in order.
+#define FPGA_REG_LIST_SIZE 1024
+#define FPGA_REG_REPLY_SIZE 1024
+
+#define FPGA_REG_READ 1
+#define FPGA_REG_WRITE 2
+// Read `length` (1-4) bytes until (value & mask) == expected, at most `tries` (> 0)
+// times and for no longer than FPGA_REG_POLL_MAX_MS
+#define FPGA_REG_POLL 3
+#define FPGA_REG_POLL_MAX_MS 100
+// Keep reading the register at `addr` (a FIFO in the user logic) into
+// FPGA_CAPTURE_BUFFER_SIZE byte buffers, each sent as an FPGA_CaptureHeader
+// followed by the data, until FPGA_REG_CAPTURE_STOP.
+#define FPGA_REG_CAPTURE_START 4
+// Both reply with an FPGA_CaptureStats
+#define FPGA_REG_CAPTURE_STOP 5
+#define FPGA_REG_CAPTURE_STATS 6
+// `length` bytes of XSVF follow; bit 0 of `addr` starts a new file
+#define FPGA_REG_XSVF 7
+
+#define FPGA_REG_OK 0
+#define FPGA_REG_ERR_OP 1      // unknown op, or it runs past the end of the list
+#define FPGA_REG_ERR_SIZE 2    // list or reply too large
+#define FPGA_REG_ERR_TIMEOUT 3 // poll didn't match in time
+#define FPGA_REG_CAPTURE_DATA 4 // not a reply, but a buffer of captured data
+#define FPGA_REG_ERR_JTAG 5     // the XSVF player stopped; see JTAG.TXT
+
+#define FPGA_CAPTURE_BUFFER_SIZE 1024
+
+typedef struct {
+    uint16_t tag;
+    uint16_t size;
+} FPGA_RegList;
+
+typedef struct {
+    uint8_t op;
+    uint8_t length;
+    uint16_t addr;
+} FPGA_RegOp;
+
+typedef struct {
+    uint32_t mask;
+    uint32_t expected;
+    uint32_t tries;
+} FPGA_RegPoll;
+
+typedef struct {
+    uint16_t tag;
+    uint16_t status;
+    uint16_t failed_op; // index of the op that failed
+    uint16_t size;      // of the data that follows
+} FPGA_RegReply;
+
+// Same layout as FPGA_RegReply, told apart by the status
+typedef struct {
+    uint16_t sequence;
+    uint16_t status;   // FPGA_REG_CAPTURE_DATA
+    uint16_t overruns; // so far, saturating
+    uint16_t size;
+} FPGA_CaptureHeader;
+
+typedef struct {
+    uint32_t bytes;
+    uint32_t buffers;
+    // the SPI had to wait, as both buffers were waiting for USB; samples may be lost
+    uint32_t overruns;
+    uint32_t bytes_per_second;
+} FPGA_CaptureStats;
+
+// USB traffic per endpoint number; both directions share an entry
+typedef struct {
+    uint32_t rx_bytes; // from the host
+    uint32_t rx_packets;
+    uint32_t tx_bytes; // to the host
+    uint32_t tx_packets;
+    uint32_t wait_us; // busy-waiting for the host
+    uint32_t stalls;
+} USB_EndpointStats;
+
+typedef struct {
+    uint32_t resets; // bus resets
+    uint32_t setups; // control requests
+    // ext_flash_read_sector(); zero without an external flash
+    uint32_t flash_cache_hits;
+    uint32_t flash_cache_misses;
+    USB_EndpointStats ep[MAX_EP];
+} USB_Stats;
+
+// SCSI commands are timed from the CBW to the CSW. Histogram bucket n counts
+// those under 64us << 2n, the last one the rest.
+#define SCSI_LATENCY_BUCKETS 6
+#define SCSI_STATS_OPCODES 6
+#define SCSI_STATS_OTHER 0xff
+
+typedef struct {
+    uint8_t opcode; // SCSI_STATS_OTHER for all the ones without an entry
+    uint8_t reserved[3];
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t total_us;
+    uint32_t histogram[SCSI_LATENCY_BUCKETS];
+} SCSI_OpcodeStats;
+
+typedef struct {
+    uint32_t num_opcodes;
+    SCSI_OpcodeStats opcodes[SCSI_STATS_OPCODES];
+} SCSI_Stats;
+
 // needs to be more than ~4200 (to force FAT16)
 #define NUM_FAT_BLOCKS 8000
 
@@ -52,10 +274,12 @@
 #define USE_UART 0
 // Support Human Interface Device (HID) - serial, flashing and debug
 #define USE_HID 0 // 788 bytes
-// Expose HID via WebUSB
+// Expose HF2 on a vendor bulk interface, advertised via WebUSB
 #define USE_WEBUSB 0
 // Doesn't yet disable code, just enumeration
 #define USE_MSC 1
+// Count USB traffic per endpoint and time SCSI commands; see STATS.TXT
+#define USE_USB_STATS 1
 
 // If enabled, bootloader will start on power-on and every reset. A second reset
 // will start the app. This only happens if the app says it wants that (see SINGLE_RESET() below).
@@ -71,6 +295,21 @@
 #define USE_MSC_CHECKS 0   // check validity of MSC commands; 460 bytes
 #define USE_CDC_TERMINAL 1 // enable ASCII mode on CDC loop (not used by BOSSA); 228 bytes
 #define USE_DBG_MSC 1      // output debug info about MSC
+#ifdef BOARD_FLASH_CS_PIN
+#define USE_FLASH_LUN 1    // raw external SPI flash as a second MSC LUN
+#else
+#define USE_FLASH_LUN 0
+#endif
+#if defined(BOARD_FLASH_CS_PIN) && USE_CDC
+#define USE_SERPROG 1      // flashrom serprog programmer on the CDC port
+#else
+#define USE_SERPROG 0
+#endif
+#ifdef BOARD_FPGA_REG_CS_PIN
+#define USE_FPGA_REGS 1    // vendor bulk interface for FPGA register access
+#else
+#define USE_FPGA_REGS 0
+#endif
 
 #if USE_CDC
 #define CDC_VERSION "S"
@@ -127,7 +366,9 @@
 // End of config
 
 #define USE_MONITOR (USE_CDC || USE_UART)
+// timerHigh runs at about 200Hz: TIMER_TICKS SysTicks, or TIMER_STEP USB polls
 #define TIMER_STEP 1500
+#define TIMER_TICKS (SYSTICK_HZ / 200)
 
 #ifdef BOARD_NEOPIXEL_PIN
 #define COLOR_START 0x040000
@@ -203,16 +444,26 @@ void copy_words(uint32_t *dst, uint32_t *src, uint32_t n_words);
 int writeNum(char *buf, uint32_t n, bool full);
 
 void process_hid(void);
+// Drop half-received HF2 messages after the host reconfigured the device.
+void hid_reset(void);
 
-// index of highest LUN
+// index of highest LUN; LUN 1 is the raw external SPI flash
+#if USE_FLASH_LUN
+#define MAX_LUN 1
+#else
 #define MAX_LUN 0
+#endif
 void process_msc(void);
 void msc_reset(void);
 //! Static block size for all memories
 #define UDI_MSC_BLOCK_SIZE 512L
 
 void read_block(uint32_t block_no, uint8_t *data);
+#ifdef BOARD_FLASH_CS_PIN
+#define MAX_BLOCKS (SPI_FLASH_MAX_SIZE / 256 + 100)
+#else
 #define MAX_BLOCKS (FLASH_SIZE / 256 + 100)
+#endif
 typedef struct {
     uint32_t numBlocks;
     uint32_t numWritten;
@@ -221,6 +472,140 @@ typedef struct {
 void write_block(uint32_t block_no, uint8_t *data, bool quiet, WriteState *state);
 void padded_memcpy(char *dst, const char *src, int len);
 
+// External SPI flash holding the FPGA bitstream; addresses are offsets into the flash.
+// `end` is where the current upload is expected to stop; it lets the erase
+// planner pick 32K/64K block erases for regions that get fully rewritten.
+// Until their sector is erased, pages are compared with the flash first; ones
+// already there are skipped, and ones that only clear bits skip the erase.
+void ext_flash_write_page(uint32_t addr, uint8_t *src, uint32_t end);
+// Same for a 512 byte MSC block; parts of a 4K sector outside [addr, end) are preserved.
+void ext_flash_write_block(uint32_t addr, uint8_t *src, uint32_t end);
+// Program queued pages; returns right away while the flash is busy.
+void ext_flash_process(void);
+// Wait until every queued page is programmed.
+void ext_flash_flush(void);
+// CRC-32 over a range of the flash, clipped to its size.
+uint32_t ext_flash_crc32(uint32_t addr, uint32_t len);
+// Erase the 4K sector holding the page and program the page.
+void ext_flash_replace_page(uint32_t addr, uint8_t *src);
+// Read 512 bytes at addr (normally sector aligned), through the RAM cache.
+void ext_flash_read_sector(uint32_t addr, uint8_t *dst);
+extern uint32_t ext_flash_cache_hits, ext_flash_cache_misses;
+// Drop all cached sectors, after the flash was written behind our back.
+void ext_flash_invalidate_cache(void);
+
+enum {
+    BITSTREAM_UNKNOWN,
+    BITSTREAM_XILINX_BIT, // .bit file with its header
+    BITSTREAM_XILINX_BIN,
+    BITSTREAM_ICE40,
+    BITSTREAM_ECP5,
+};
+
+typedef struct {
+    uint32_t format;
+    uint32_t header; // bytes of file header in front of the configuration data
+    uint32_t length; // of the configuration data according to the header; 0 if unknown
+} BitstreamInfo;
+
+// Recognize the format from the start of a bitstream file.
+void bitstream_parse(const uint8_t *data, uint32_t len, BitstreamInfo *info);
+const char *bitstream_format_name(uint32_t format);
+// Length of data without trailing 0xff (erased flash) padding.
+uint32_t bitstream_trim(const uint8_t *data, uint32_t len);
+// ext_flash_write_page() for UF2 uploads; `first` marks the first page of the file.
+// Pages past the payload announced in the header are dropped.
+void bitstream_write_page(uint32_t addr, uint8_t *src, uint32_t end, bool first);
+// Length of the upload that started at addr, without the padding; 0 if there was none.
+uint32_t bitstream_upload_length(uint32_t addr);
+
+// flashrom serprog; serprog_command() runs the command at buf[0] and returns
+// the number of bytes of buf it used, reading the rest from the CDC port.
+bool serprog_is_command(uint8_t c);
+uint32_t serprog_command(const uint8_t *buf, uint32_t length);
+
+// FPGA configuration port
+void fpga_init(void);
+bool fpga_done(void);
+// Stream a block of a FPGA_STREAM_FAMILY_ID file; blocks have to come in order.
+// Returns false if the block has to be dropped; otherwise pass its (decoded)
+// payload to fpga_stream_write() and finish with fpga_stream_end_block().
+bool fpga_stream_begin_block(UF2_Block *bl);
+void fpga_stream_write(uint8_t *data, uint32_t len);
+void fpga_stream_end_block(UF2_Block *bl);
+// Run an FPGA_Control command; false if it failed.
+bool fpga_control(const FPGA_Control *ctrl);
+void fpga_config_stats(FPGA_ConfigStats *stats);
+// Bring FPGA.TXT up to date with CDONE.
+void fpga_update_status(void);
+// JTAG TAP states, numbered as in XSVF
+enum {
+    JTAG_RESET,
+    JTAG_IDLE,
+    JTAG_SELECT_DR,
+    JTAG_CAPTURE_DR,
+    JTAG_SHIFT_DR,
+    JTAG_EXIT1_DR,
+    JTAG_PAUSE_DR,
+    JTAG_EXIT2_DR,
+    JTAG_UPDATE_DR,
+    JTAG_SELECT_IR,
+    JTAG_CAPTURE_IR,
+    JTAG_SHIFT_IR,
+    JTAG_EXIT1_IR,
+    JTAG_PAUSE_IR,
+    JTAG_EXIT2_IR,
+    JTAG_UPDATE_IR,
+};
+
+void jtag_init(void);
+// Drive the JTAG pins and reset the TAP; jtag_end() tristates them again.
+void jtag_begin(void);
+void jtag_end(void);
+void jtag_reset(void);
+void jtag_goto(uint8_t state);
+// Clock TCK with TMS low, e.g. in Run-Test/Idle.
+void jtag_idle(uint32_t clocks);
+// Shift nbits in Shift-DR/IR, bit 0 of tdi[0] first; tdi may be NULL for zeros,
+// tdo NULL if the output doesn't matter. With exit, the last bit leaves for Exit1.
+void jtag_shift(const uint8_t *tdi, uint8_t *tdo, uint32_t nbits, bool exit);
+
+#define XSVF_MAX_VECTOR_BYTES 256
+
+#define XSVF_IDLE 0
+#define XSVF_RUNNING 1
+#define XSVF_DONE 2
+#define XSVF_ERR_UNSUPPORTED 3
+#define XSVF_ERR_TDO_MISMATCH 4
+#define XSVF_ERR_ORDER 5
+#define XSVF_ERR_TRUNCATED 6
+
+void xsvf_begin(void);
+void xsvf_write(const uint8_t *data, uint32_t len);
+uint8_t xsvf_result(void);
+// Same protocol as fpga_stream_begin_block() and friends.
+bool xsvf_begin_block(UF2_Block *bl);
+void xsvf_end_block(UF2_Block *bl);
+extern char jtagStatusFile[];
+
+// Serve the register interface on USB_EP_FPGA.
+void process_fpga_regs(void);
+// Drop a half-received register list after the host reconfigured the device.
+void fpga_regs_reset(void);
+// Stop a running capture and wait for its last buffer; the FPGA is about to be
+// configured and the capture would clock into the bitstream.
+void fpga_regs_capture_stop(void);
+// Pulse CRESET and let the FPGA load itself from the flash; true if CDONE went high.
+bool fpga_boot_from_flash(void);
+// Contents of FPGA.TXT on the MSC drive
+extern char fpgaStatusFile[];
+// False if addr lies in a slot that doesn't fit into the detected flash.
+bool fpga_slot_addr_ok(uint32_t addr);
+// Length of the bitstream in the active slot, 0 if there is none.
+uint32_t fpga_bitstream_size(void);
+// Read 512 bytes of it, zero padded past its end.
+void fpga_read_bitstream(uint32_t offset, uint8_t *dst);
+
 
 // Last word in RAM
 // Unlike for ordinary applications, our link script doesn't place the stack at the bottom
@@ -247,7 +632,7 @@ void system_init(void);
 #define LED_TICK led_tick
 
 #define PINOP(pin, OP) (PORT->Group[(pin) / 32].OP.reg = (1 << ((pin) % 32)))
-#define PINVAL(pin)    (PORT->Group[(pin) / 32].PINVAL.reg & (1 << ((pin) % 32)))
+#define PINVAL(pin)    (PORT->Group[(pin) / 32].IN.reg & (1 << ((pin) % 32)))
 
 void led_tick(void);
 void led_signal(void);
@@ -259,7 +644,37 @@ void RGBLED_set_color(uint32_t color);
 #define LED_MSC_TGL() PINOP(LED_PIN, OUTTGL)
 
 extern uint32_t timerHigh, resetHorizon;
+// SysTick interrupts since boot
+extern volatile uint32_t sysTicks;
+#define SYSTICK_HZ (CPU_FREQUENCY / 1000)
+// CPU clock cycles since boot, from SysTick; wraps after ~89s, so only for intervals
+uint32_t cpu_cycles(void);
 void timerTick(void);
+
+#if USE_USB_STATS
+extern USB_Stats usb_stats;
+#define USB_STATS_ADD(field, n) (usb_stats.field += (n))
+static inline uint32_t usb_stats_now(void) {
+    return cpu_cycles();
+}
+static inline void usb_stats_waited(uint32_t ep, uint32_t start) {
+    usb_stats.ep[ep].wait_us += (cpu_cycles() - start) / (CPU_FREQUENCY / 1000000);
+}
+void usb_stats_get(USB_Stats *st);
+// Account a SCSI command that came in at usb_stats_now() == start.
+void scsi_stats_record(uint8_t opcode, uint32_t start);
+void scsi_stats_get(SCSI_Stats *st);
+// Contents of STATS.TXT on the MSC drive; refreshed by usb_stats_update_file()
+extern char usbStatsFile[];
+void usb_stats_update_file(void);
+#else
+#define USB_STATS_ADD(field, n) ((void)0)
+static inline uint32_t usb_stats_now(void) {
+    return 0;
+}
+static inline void usb_stats_waited(uint32_t ep, uint32_t start) {}
+static inline void scsi_stats_record(uint8_t opcode, uint32_t start) {}
+#endif
 void delay(uint32_t ms);
 void hidHandoverLoop(int ep);
 void handoverPrep(void);
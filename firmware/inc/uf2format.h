@@ -20,6 +20,14 @@
 
 // If set, the block is "comment" and should not be flashed to the device
 #define UF2_FLAG_NOFLASH 0x00000001
+// If set, the `reserved` field holds the family ID of the target the block is meant for
+#define UF2_FLAG_FAMILYID_PRESENT 0x00002000
+// If set, the payload is RLE compressed: a little endian uint32_t with the decoded size
+// (a multiple of 256, at most UF2_RLE_MAX_SIZE), followed by the RLE stream. A control
+// byte c < 0x80 is followed by c + 1 literal bytes; c >= 0x80 is followed by one byte
+// that is repeated c - 0x80 + 3 times.
+#define UF2_FLAG_RLE 0x00010000
+#define UF2_RLE_MAX_SIZE 0x8000
 
 typedef struct {
     // 32 byte header
@@ -58,6 +58,58 @@ struct HF2_WRITE_WORDS_Command {
 };
 // no result
 
+#define HF2_CMD_CRC32_SPI_FLASH 0x0020
+struct HF2_CRC32_SPI_FLASH_Command {
+    uint32_t target_addr; // offset into the external SPI flash
+    uint32_t num_bytes;
+};
+struct HF2_CRC32_SPI_FLASH_Result {
+    uint32_t crc32;
+};
+
+#define HF2_CMD_FPGA_CONTROL 0x0021
+// same layout as FPGA_Control in uf2.h
+struct HF2_FPGA_CONTROL_Command {
+    uint32_t command; // FPGA_CTRL_COMMIT or FPGA_CTRL_SELECT
+    uint32_t slot;
+    uint32_t length;
+    uint32_t version;
+};
+// no result; HF2_STATUS_EXEC_ERR if the command failed
+
+#define HF2_CMD_FPGA_STATUS 0x0022
+// no arguments
+// result is an FPGA_ConfigStats (see uf2.h): configuration timing and history
+
+// The two below are acknowledged before the data is written, so the host can
+// send the next command meanwhile. On the bulk interface (USE_WEBUSB) it may
+// keep several in flight; they run in order and USB flow control holds back
+// the rest. Messages can be up to max_message_size from BININFO.
+
+#define HF2_CMD_WRITE_FLASH_PAGES 0x0023
+struct HF2_WRITE_FLASH_PAGES_Command {
+    uint32_t target_addr;
+    uint32_t data[0]; // any number of whole pages
+};
+// no result
+
+#define HF2_CMD_WRITE_SPI_FLASH 0x0024
+struct HF2_WRITE_SPI_FLASH_Command {
+    uint32_t target_addr; // offset into the external SPI flash, page aligned
+    uint32_t end_addr;    // end of the whole image; its sectors are then erased once
+    uint32_t data[0];     // whole 256 byte pages
+};
+// no result; CRC32_SPI_FLASH waits for the writes to finish
+
+#define HF2_CMD_USB_STATS 0x0025
+struct HF2_USB_STATS_Command {
+    uint32_t which; // HF2_USB_STATS_BUS or HF2_USB_STATS_SCSI
+};
+#define HF2_USB_STATS_BUS 0
+#define HF2_USB_STATS_SCSI 1
+// result is a USB_Stats or a SCSI_Stats (see uf2.h); HF2_STATUS_EXEC_ERR if
+// USE_USB_STATS is off
+
 #define HF2_CMD_DMESG 0x0010
 // no arguments
 // results is utf8 character array
@@ -73,6 +125,11 @@ typedef struct {
         struct HF2_WRITE_WORDS_Command write_words;
         struct HF2_READ_WORDS_Command read_words;
         struct HF2_CHKSUM_PAGES_Command chksum_pages;
+        struct HF2_CRC32_SPI_FLASH_Command crc32_spi_flash;
+        struct HF2_FPGA_CONTROL_Command fpga_control;
+        struct HF2_WRITE_FLASH_PAGES_Command write_flash_pages;
+        struct HF2_WRITE_SPI_FLASH_Command write_spi_flash;
+        struct HF2_USB_STATS_Command usb_stats;
     };
 } HF2_Command;
 
@@ -102,5 +159,6 @@ typedef struct {
 
 #define HF2_STATUS_OK 0x00
 #define HF2_STATUS_INVALID_CMD 0x01
+#define HF2_STATUS_EXEC_ERR 0x02
 
 #endif
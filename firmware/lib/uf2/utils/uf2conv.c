@@ -1,10 +1,46 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "uf2format.h"
 
+// RLE encode one page (see UF2_FLAG_RLE); returns the encoded size.
+static int rle_encode(const uint8_t *src, int len, uint8_t *dst) {
+    int i = 0, o = 0;
+    while (i < len) {
+        int run = 1;
+        while (i + run < len && run < 130 && src[i + run] == src[i])
+            run++;
+        if (run >= 3) {
+            dst[o++] = 0x80 + run - 3;
+            dst[o++] = src[i];
+            i += run;
+        } else {
+            int start = i, n = 0;
+            // literal bytes up to the next run worth encoding
+            while (i < len && n < 128) {
+                if (i + 2 < len && src[i] == src[i + 1] && src[i] == src[i + 2])
+                    break;
+                i++;
+                n++;
+            }
+            dst[o++] = n - 1;
+            memcpy(dst + o, src + start, n);
+            o += n;
+        }
+    }
+    return o;
+}
+
 int main(int argc, char **argv) {
+    int compress = 0;
+    if (argc > 1 && !strcmp(argv[1], "-z")) {
+        compress = 1;
+        argc--;
+        argv++;
+    }
     if (argc < 2) {
-        fprintf(stderr, "USAGE: %s file.bin [file.uf2]\n", argv[0]);
+        fprintf(stderr, "USAGE: %s [-z] file.bin [file.uf2]\n", argv[0]);
+        fprintf(stderr, "  -z  RLE compress the payload\n");
         return 1;
     }
     FILE *f = fopen(argv[1], "rb");
@@ -17,29 +53,61 @@ int main(int argc, char **argv) {
     uint32_t sz = ftell(f);
     fseek(f, 0L, SEEK_SET);
 
+    // whole pages, padded with zeros
+    uint32_t padded = (sz + 255) & ~255;
+    uint8_t *buf = calloc(padded ? padded : 1, 1);
+    if (fread(buf, 1, sz, f) != sz) {
+        fprintf(stderr, "Can't read %s\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
     const char *outname = argc > 2 ? argv[2] : "flash.uf2";
 
     FILE *fout = fopen(outname, "wb");
 
-    UF2_Block bl;
-    memset(&bl, 0, sizeof(bl));
-
-    bl.magicStart0 = UF2_MAGIC_START0;
-    bl.magicStart1 = UF2_MAGIC_START1;
-    bl.magicEnd = UF2_MAGIC_END;
-    bl.targetAddr = APP_START_ADDRESS;
-    bl.numBlocks = (sz + 255) / 256;
-    bl.payloadSize = 256;
-    int numbl = 0;
-    while (fread(bl.data, 1, bl.payloadSize, f)) {
-        bl.blockNo = numbl++;
-        fwrite(&bl, 1, sizeof(bl), fout);
-        bl.targetAddr += bl.payloadSize;
-        // clear for next iteration, in case we get a short read
-        memset(bl.data, 0, sizeof(bl.data));
+    // at most one block per page
+    uint32_t maxblocks = padded / 256;
+    UF2_Block *blocks = calloc(maxblocks ? maxblocks : 1, sizeof(UF2_Block));
+    uint32_t numbl = 0;
+
+    for (uint32_t ptr = 0; ptr < padded; numbl++) {
+        UF2_Block *bl = &blocks[numbl];
+        bl->magicStart0 = UF2_MAGIC_START0;
+        bl->magicStart1 = UF2_MAGIC_START1;
+        bl->magicEnd = UF2_MAGIC_END;
+        bl->targetAddr = APP_START_ADDRESS + ptr;
+
+        if (!compress) {
+            bl->payloadSize = 256;
+            memcpy(bl->data, buf + ptr, 256);
+            ptr += 256;
+            continue;
+        }
+
+        // as many pages as fit, each encoded on its own
+        uint32_t size = 0;
+        bl->flags = UF2_FLAG_RLE;
+        bl->payloadSize = 4;
+        while (ptr + size < padded && size < UF2_RLE_MAX_SIZE) {
+            uint8_t enc[256 + 2];
+            int n = rle_encode(buf + ptr + size, 256, enc);
+            if (bl->payloadSize + n > sizeof(bl->data))
+                break;
+            memcpy(bl->data + bl->payloadSize, enc, n);
+            bl->payloadSize += n;
+            size += 256;
+        }
+        memcpy(bl->data, &size, 4);
+        ptr += size;
+    }
+
+    for (uint32_t i = 0; i < numbl; ++i) {
+        blocks[i].blockNo = i;
+        blocks[i].numBlocks = numbl;
+        fwrite(&blocks[i], 1, sizeof(UF2_Block), fout);
     }
     fclose(fout);
-    fclose(f);
     printf("Wrote %d blocks to %s\n", numbl, outname);
     return 0;
-}
\ No newline at end of file
+}
@@ -15,6 +15,28 @@ UF2_MAGIC_END    = 0x0AB16F30 # Ditto
 INFO_FILE = "/INFO_UF2.TXT"
 
 appstartaddr = 0x2000
+familyid = 0x0
+
+UF2_FLAG_FAMILYID_PRESENT = 0x00002000
+UF2_FLAG_RLE = 0x00010000
+UF2_RLE_MAX_SIZE = 0x8000
+
+compress = False
+
+# bitstream slots of the FPGA helper (see FPGA_SLOT_* in inc/uf2.h)
+FPGA_CONTROL_FAMILY = 0x5c41e7a2
+FPGA_SLOT_BASE = 0x10000
+FPGA_SLOT_SIZE = 0x40000
+FPGA_SLOT_HEADER_SIZE = 256
+FPGA_CTRL_COMMIT = 1
+FPGA_CTRL_SELECT = 2
+
+# family IDs understood by the FPGA helper
+FAMILIES = {
+    "FLASH": 0x7a2f4c1b,  # store in the external SPI flash, base is the flash offset
+    "FPGA": 0x3d9e0a57,   # clock straight into the FPGA, nothing is stored
+    "XSVF": 0x6b1e93c4,   # play on the JTAG header, nothing is stored
+}
 
 def isUF2(buf):
     w = struct.unpack("<II", buf[0:8])
@@ -61,7 +83,59 @@ def convertFromUF2(buf):
         curraddr = newaddr + datalen
     return outp
 
+# RLE encode one page; see UF2_FLAG_RLE in uf2format.h
+def rleEncode(data):
+    outp = ""
+    i = 0
+    while i < len(data):
+        run = 1
+        while i + run < len(data) and run < 130 and data[i + run] == data[i]:
+            run += 1
+        if run >= 3:
+            outp += chr(0x80 + run - 3) + data[i]
+            i += run
+        else:
+            start = i
+            while i < len(data) and i - start < 128:
+                if i + 2 < len(data) and data[i] == data[i + 1] == data[i + 2]:
+                    break
+                i += 1
+            outp += chr(i - start - 1) + data[start:i]
+    return outp
+
+def convertToCompressedUF2(fileContent):
+    while len(fileContent) % 256:
+        fileContent += "\x00"
+    flags = UF2_FLAG_RLE
+    if familyid:
+        flags |= UF2_FLAG_FAMILYID_PRESENT
+    blocks = []
+    ptr = 0
+    while ptr < len(fileContent):
+        # as many pages as fit, each encoded on its own
+        size = 0
+        payload = ""
+        while ptr + size < len(fileContent) and size < UF2_RLE_MAX_SIZE:
+            enc = rleEncode(fileContent[ptr + size:ptr + size + 256])
+            if 4 + len(payload) + len(enc) > 476:
+                break
+            payload += enc
+            size += 256
+        blocks.append((ptr, struct.pack("<I", size) + payload))
+        ptr += size
+    outp = ""
+    for blockno in range(0, len(blocks)):
+        addr, payload = blocks[blockno]
+        hd = struct.pack("<IIIIIIII",
+            UF2_MAGIC_START0, UF2_MAGIC_START1,
+            flags, addr + appstartaddr, len(payload), blockno, len(blocks), familyid)
+        payload += "\x00" * (476 - len(payload))
+        outp += hd + payload + struct.pack("<I", UF2_MAGIC_END)
+    return outp
+
 def convertToUF2(fileContent):
+    if compress:
+        return convertToCompressedUF2(fileContent)
     datapadding = ""
     while len(datapadding) < 512 - 256 - 32 - 4:
         datapadding += "\x00\x00\x00\x00"
@@ -70,9 +144,12 @@ def convertToUF2(fileContent):
     for blockno in range(0, numblocks):
         ptr = 256 * blockno
         chunk = fileContent[ptr:ptr + 256]
+        flags = 0
+        if familyid:
+            flags |= UF2_FLAG_FAMILYID_PRESENT
         hd = struct.pack("<IIIIIIII",  
             UF2_MAGIC_START0, UF2_MAGIC_START1, 
-            0, ptr + appstartaddr, 256, blockno, numblocks, 0)
+            flags, ptr + appstartaddr, 256, blockno, numblocks, familyid)
         while len(chunk) < 256:
             chunk += "\x00"
         block = hd + chunk + datapadding + struct.pack("<I", UF2_MAGIC_END)
@@ -80,6 +157,20 @@ def convertToUF2(fileContent):
         outp += block
     return outp
 
+# Append a block carrying an FPGA_Control command, renumbering the existing blocks.
+def appendControlBlock(outp, command, slot, length=0, version=0):
+    numblocks = len(outp) / 512 + 1
+    res = ""
+    for blockno in range(0, numblocks - 1):
+        block = outp[blockno * 512:(blockno + 1) * 512]
+        res += block[0:24] + struct.pack("<I", numblocks) + block[28:]
+    hd = struct.pack("<IIIIIIII",
+        UF2_MAGIC_START0, UF2_MAGIC_START1,
+        UF2_FLAG_FAMILYID_PRESENT, 0, 16, numblocks - 1, numblocks, FPGA_CONTROL_FAMILY)
+    payload = struct.pack("<IIII", command, slot, length, version)
+    payload += "\x00" * (476 - len(payload))
+    return res + hd + payload + struct.pack("<I", UF2_MAGIC_END)
+
 class Block:
     def __init__(self, addr):
         self.addr = addr
@@ -177,7 +268,7 @@ def writeFile(name, buf):
     print "Wrote %d bytes to %s." % (len(buf), name)
 
 def main():
-    global appstartaddr
+    global appstartaddr, familyid, compress
     def error(msg):
         print msg
         sys.exit(1)
@@ -187,6 +278,16 @@ def main():
     parser.add_argument('-b' , '--base', dest='base', type=str,
                         default="0x2000",
                         help='set base address of application for BIN format (default: 0x2000)')
+    parser.add_argument('-f' , '--family', dest='family', type=str,
+                        help='tag blocks with a family ID: FLASH, FPGA or a number')
+    parser.add_argument('-z' , '--compress', action='store_true',
+                        help='RLE compress the payload of BIN input')
+    parser.add_argument('-s' , '--slot', dest='slot', type=int,
+                        help='store a BIN bitstream in this FPGA slot of the external flash')
+    parser.add_argument('-V' , '--bitstream-version', dest='version', type=str, default="0",
+                        help='version recorded in the slot header (default: 0)')
+    parser.add_argument('--select', dest='select', type=int,
+                        help='make this FPGA slot active; with no input, just switch slots')
     parser.add_argument('-o' , '--output', metavar="FILE", dest='output', type=str,
                         help='write output to named file; defaults to "flash.uf2" or "flash.bin" where sensible')
     parser.add_argument('-d' , '--device', dest="device_path",
@@ -197,22 +298,43 @@ def main():
                         help='do not flash, just convert')
     args = parser.parse_args()
     appstartaddr = int(args.base, 0)
+    compress = args.compress
+    if args.family:
+        if args.family.upper() in FAMILIES:
+            familyid = FAMILIES[args.family.upper()]
+        else:
+            familyid = int(args.family, 0)
+        if args.base == "0x2000":
+            # family IDs address their own memory from zero
+            appstartaddr = 0
+    if args.slot != None:
+        familyid = FAMILIES["FLASH"]
+        appstartaddr = FPGA_SLOT_BASE + args.slot * FPGA_SLOT_SIZE + FPGA_SLOT_HEADER_SIZE
     if args.list:
         listdrives()
     else:
-        if not args.input:
-            error("Need input file")
-        with open(args.input, mode='rb') as file:
-            inpbuf = file.read()
-        fromUF2 = isUF2(inpbuf)
         ext = "uf2"
-        if fromUF2:
-            outbuf = convertFromUF2(inpbuf)
-            ext = "bin"
-        elif isHEX(inpbuf):
-            outbuf = convertFromHexToUF2(inpbuf)
+        if args.select != None and not args.input:
+            outbuf = appendControlBlock("", FPGA_CTRL_SELECT, args.select)
         else:
-            outbuf = convertToUF2(inpbuf)
+            if not args.input:
+                error("Need input file")
+            with open(args.input, mode='rb') as file:
+                inpbuf = file.read()
+            fromUF2 = isUF2(inpbuf)
+            if fromUF2:
+                outbuf = convertFromUF2(inpbuf)
+                ext = "bin"
+            elif isHEX(inpbuf):
+                outbuf = convertFromHexToUF2(inpbuf)
+            else:
+                outbuf = convertToUF2(inpbuf)
+                if args.slot != None:
+                    # length 0: the device commits what it received, minus the padding
+                    outbuf = appendControlBlock(outbuf, FPGA_CTRL_COMMIT, args.slot,
+                                                0, int(args.version, 0))
+                    if args.select != None:
+                        outbuf = appendControlBlock(outbuf, FPGA_CTRL_SELECT, args.select)
         print "Converting to %s, output size: %d, start address: 0x%x" % (ext, len(outbuf), appstartaddr)
 
         if args.convert:
@@ -0,0 +1,150 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * FPGA bitstream formats
+ *
+ * Bitstream files often carry a vendor header in front of the configuration
+ * data, and tools pad them to the size of the device or flash image with 0xff.
+ * Uploads to the external flash are passed through here, so only the real
+ * payload is programmed and its length is known when the slot is committed.
+ */
+
+#include "uf2.h"
+
+#ifdef BOARD_FLASH_CS_PIN
+
+// Xilinx .bit: this magic, then fields tagged 'a' (design name), 'b' (part),
+// 'c' (date) and 'd' (time) with a 16 bit length, and finally 'e' with the 32
+// bit length of the raw bitstream that follows. All big endian.
+static const uint8_t xilinx_bit_magic[] = {0x00, 0x09, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f,
+                                           0xf0, 0x0f, 0xf0, 0x00, 0x00, 0x01};
+static const uint8_t xilinx_sync[] = {0xaa, 0x99, 0x55, 0x66};
+static const uint8_t ice40_sync[] = {0x7e, 0xaa, 0x99, 0x7e};
+static const uint8_t ecp5_preamble[] = {0xff, 0xff, 0xbd, 0xb3};
+
+static uint32_t get_be16(const uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (get_be16(p) << 16) | get_be16(p + 2);
+}
+
+static bool parse_xilinx_bit(const uint8_t *data, uint32_t len, BitstreamInfo *info) {
+    if (len < sizeof(xilinx_bit_magic) || memcmp(data, xilinx_bit_magic, sizeof(xilinx_bit_magic)))
+        return false;
+
+    uint32_t p = sizeof(xilinx_bit_magic);
+    while (p + 3 <= len) {
+        if (data[p] == 'e') {
+            if (p + 5 > len)
+                return false;
+            info->header = p + 5;
+            info->length = get_be32(data + p + 1);
+            return true;
+        }
+        if (data[p] < 'a' || data[p] > 'd')
+            return false;
+        p += 3 + get_be16(data + p + 1);
+    }
+    // the header is longer than what we got to see
+    return false;
+}
+
+// The sync word may follow a comment or some dummy bytes; they don't hurt the FPGA.
+static bool has_sync(const uint8_t *data, uint32_t len, const uint8_t *sync) {
+    for (uint32_t i = 0; i + 4 <= len; ++i)
+        if (!memcmp(data + i, sync, 4))
+            return true;
+    return false;
+}
+
+void bitstream_parse(const uint8_t *data, uint32_t len, BitstreamInfo *info) {
+    memset(info, 0, sizeof(*info));
+    if (parse_xilinx_bit(data, len, info))
+        info->format = BITSTREAM_XILINX_BIT;
+    else if (has_sync(data, len, ice40_sync))
+        info->format = BITSTREAM_ICE40;
+    else if (has_sync(data, len, ecp5_preamble))
+        info->format = BITSTREAM_ECP5;
+    else if (has_sync(data, len, xilinx_sync))
+        info->format = BITSTREAM_XILINX_BIN;
+}
+
+const char *bitstream_format_name(uint32_t format) {
+    switch (format) {
+    case BITSTREAM_XILINX_BIT:
+        return "Xilinx .bit";
+    case BITSTREAM_XILINX_BIN:
+        return "Xilinx";
+    case BITSTREAM_ICE40:
+        return "iCE40";
+    case BITSTREAM_ECP5:
+        return "ECP5";
+    }
+    return "unknown";
+}
+
+// Zeros can't be told apart from configuration data (iCE40 bitstreams end in
+// one), so only the erased value counts as padding.
+uint32_t bitstream_trim(const uint8_t *data, uint32_t len) {
+    while (len && data[len - 1] == 0xff)
+        len--;
+    return len;
+}
+
+// The upload currently going to the flash; a new one starts with block 0.
+static BitstreamInfo upload;
+static uint32_t upload_start, upload_end;
+
+void bitstream_write_page(uint32_t addr, uint8_t *src, uint32_t end, bool first) {
+    if (first) {
+        bitstream_parse(src, SPI_FLASH_PAGE_SIZE, &upload);
+        upload_start = upload_end = addr;
+    }
+
+    if (addr >= upload_start) {
+        // the header says where the payload stops; the rest is padding
+        if (upload.length && addr >= upload_start + upload.header + upload.length)
+            return;
+        uint32_t n = bitstream_trim(src, SPI_FLASH_PAGE_SIZE);
+        if (n && addr + n > upload_end)
+            upload_end = addr + n;
+    }
+
+    ext_flash_write_page(addr, src, end);
+}
+
+uint32_t bitstream_upload_length(uint32_t addr) {
+    if (addr != upload_start)
+        return 0;
+    uint32_t length = upload_end - upload_start;
+    if (upload.length && length > upload.header + upload.length)
+        length = upload.header + upload.length;
+    return length;
+}
+
+#endif
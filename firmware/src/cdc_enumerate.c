@@ -65,9 +65,16 @@ const char devDescriptor[] = {
     0x01            // bNumConfigs
 };
 
-#define CFG_DESC_SIZE (32 + USE_CDC * (58 + 8) + USE_HID * 32 + USE_WEBUSB * 23)
+#define CFG_DESC_SIZE                                                                              \
+    (32 + USE_CDC * (58 + 8) + USE_HID * 32 + USE_WEBUSB * 23 + USE_FPGA_REGS * 23)
+// interfaces are numbered in descriptor order, skipping the disabled ones
 #define HID_IF_NUM (USE_CDC ? 3 : 1)
-#define WEB_IF_NUM (HID_IF_NUM + 1)
+#define WEB_IF_NUM (HID_IF_NUM + USE_HID)
+#define FPGA_IF_NUM (WEB_IF_NUM + USE_WEBUSB)
+
+#if USE_FPGA_REGS && USE_HID
+#error "USB_EP_FPGA is the HID endpoint"
+#endif
 
 #if USE_HID
 // can be requested separately from the entire config desc
@@ -116,7 +123,7 @@ char cfgDescriptor[] = {
     0x02,          // CbDescriptorType
     CFG_DESC_SIZE, // CwTotalLength 2 EP + Control
     0x00,
-    1 + 2 * USE_CDC + USE_HID + USE_WEBUSB, // CbNumInterfaces
+    1 + 2 * USE_CDC + USE_HID + USE_WEBUSB + USE_FPGA_REGS, // CbNumInterfaces
     0x01,                                   // CbConfigurationValue
     0x00,                                   // CiConfiguration
     0x80,                                   // CbmAttributes 0x80 - bus-powered
@@ -275,9 +282,25 @@ char cfgDescriptor[] = {
     1,          // sub
     0,          // stringID
 
-    // interrupt endpoints with interval=1
-    7, 5, 0x80 | USB_EP_WEB, 3, PKT_SIZE, 0, 1, // in
-    7, 5, USB_EP_WEB, 3, PKT_SIZE, 0, 1,        // out
+    // bulk endpoints
+    7, 5, 0x80 | USB_EP_WEB, 2, PKT_SIZE, 0, 0, // in
+    7, 5, USB_EP_WEB, 2, PKT_SIZE, 0, 0,        // out
+#endif
+
+#if USE_FPGA_REGS
+    9,           // size
+    4,           // interface
+    FPGA_IF_NUM, // interface number
+    0,           // alternate
+    2,           // num. endpoints
+    0xFF,        // Vendor
+    0,           // sub
+    0,           // sub
+    0,           // stringID
+
+    // bulk endpoints
+    7, 5, 0x80 | USB_EP_FPGA, 2, PKT_SIZE, 0, 0, // in
+    7, 5, USB_EP_FPGA, 2, PKT_SIZE, 0, 0,        // out
 #endif
 };
 
@@ -361,7 +384,7 @@ STATIC_ASSERT(sizeof(msOS20Descriptor) == WINUSB_SIZE);
 
 #endif
 
-static uint8_t currentConfiguration;
+static volatile uint8_t currentConfiguration;
 
 typedef struct {
     uint8_t len;
@@ -541,43 +564,123 @@ void AT91F_InitUSB(void) {
     memset((uint8_t *)(&usb_endpoint_table[0]), 0, sizeof(usb_endpoint_table));
 }
 
+// Events for the main loop. USB_Handler() is the only producer and
+// usb_get_event() the only consumer, so the indices need no locking; each
+// side only writes its own.
+#define USB_EVENT_QUEUE_SIZE 16 // power of two
+
+static USB_Event usb_events[USB_EVENT_QUEUE_SIZE];
+static volatile uint8_t usb_event_head, usb_event_tail;
+static volatile uint8_t usb_events_dropped;
+static uint8_t usb_events_reported;
+// USB_Handler() runs from the NVIC; not so under a handover from the application
+static bool usb_irq_enabled;
+// IN endpoints with a USB_WriteSubmit() the host may not have taken yet
+static volatile uint8_t writesInFlight;
+
+static void usb_post_event(uint8_t type, uint8_t ep) {
+    uint8_t head = usb_event_head;
+    if ((uint8_t)(head - usb_event_tail) == USB_EVENT_QUEUE_SIZE) {
+        usb_events_dropped++;
+        return;
+    }
+    usb_events[head % USB_EVENT_QUEUE_SIZE].type = type;
+    usb_events[head % USB_EVENT_QUEUE_SIZE].ep = ep;
+    // the entry has to be complete before the consumer can see it
+    __DMB();
+    usb_event_head = head + 1;
+}
+
+bool usb_get_event(USB_Event *ev) {
+    uint8_t tail = usb_event_tail;
+    if (tail == usb_event_head) {
+        if (usb_events_reported == usb_events_dropped)
+            return false;
+        usb_events_reported = usb_events_dropped;
+        ev->type = USB_EVENT_OVERFLOW;
+        ev->ep = 0;
+        return true;
+    }
+    *ev = usb_events[tail % USB_EVENT_QUEUE_SIZE];
+    __DMB();
+    usb_event_tail = tail + 1;
+    return true;
+}
+
+bool usb_event_pending(void) {
+    return usb_event_tail != usb_event_head || usb_events_reported != usb_events_dropped;
+}
+
+static void usb_bus_reset(void) {
+    /* Set Device address as 0 */
+    USB->DEVICE.DADD.reg = USB_DEVICE_DADD_ADDEN | 0;
+    /* Configure endpoint 0 */
+    /* Configure Endpoint 0 for Control IN and Control OUT */
+    USB->DEVICE.DeviceEndpoint[0].EPCFG.reg =
+        USB_DEVICE_EPCFG_EPTYPE0(1) | USB_DEVICE_EPCFG_EPTYPE1(1);
+    USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK0RDY;
+    USB->DEVICE.DeviceEndpoint[0].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK1RDY;
+    /* Configure control OUT Packet size to 64 bytes */
+    usb_endpoint_table[0].DeviceDescBank[0].PCKSIZE.bit.SIZE = 3;
+    /* Configure control IN Packet size to 64 bytes */
+    usb_endpoint_table[0].DeviceDescBank[1].PCKSIZE.bit.SIZE = 3;
+    /* Configure the data buffer address for control OUT */
+    usb_endpoint_table[0].DeviceDescBank[0].ADDR.reg = (uint32_t)&ctrlOutCache.buf;
+    /* Configure the data buffer address for control IN */
+    usb_endpoint_table[0].DeviceDescBank[1].ADDR.reg = (uint32_t)&endpointCache[0].buf;
+    /* Set Multipacket size to 8 for control OUT and byte count to 0*/
+    usb_endpoint_table[0].DeviceDescBank[0].PCKSIZE.bit.MULTI_PACKET_SIZE = 8;
+    usb_endpoint_table[0].DeviceDescBank[0].PCKSIZE.bit.BYTE_COUNT = 0;
+    USB->DEVICE.DeviceEndpoint[0].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK0RDY;
+    /* Interrupt on SETUP packets */
+    USB->DEVICE.DeviceEndpoint[0].EPINTENSET.reg = USB_DEVICE_EPINTENSET_RXSTP;
+
+    // Reset current configuration value to 0
+    currentConfiguration = 0;
+    writesInFlight = 0;
+    USB_STATS_ADD(resets, 1);
+}
+
 //*----------------------------------------------------------------------------
-//* \fn    USB_IsConfigured
-//* \brief Test if the device is configured and handle
-// enumerationDEVICE.DeviceEndpoint[ep_num].EPCFG.bit.EPTYPE1
+//* \fn    USB_Handler
+//* \brief Services bus resets and control requests right away; transfers
+//*        completing on other endpoints are passed on as events
 //*----------------------------------------------------------------------------
-bool USB_Ok() {
-    timerTick();
-
+void USB_Handler(void) {
     /* Check for End of Reset flag */
     if (USB->DEVICE.INTFLAG.reg & USB_DEVICE_INTFLAG_EORST) {
         /* Clear the flag */
         USB->DEVICE.INTFLAG.reg = USB_DEVICE_INTFLAG_EORST;
-        /* Set Device address as 0 */
-        USB->DEVICE.DADD.reg = USB_DEVICE_DADD_ADDEN | 0;
-        /* Configure endpoint 0 */
-        /* Configure Endpoint 0 for Control IN and Control OUT */
-        USB->DEVICE.DeviceEndpoint[0].EPCFG.reg =
-            USB_DEVICE_EPCFG_EPTYPE0(1) | USB_DEVICE_EPCFG_EPTYPE1(1);
-        USB->DEVICE.DeviceEndpoint[0].EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK0RDY;
-        USB->DEVICE.DeviceEndpoint[0].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK1RDY;
-        /* Configure control OUT Packet size to 64 bytes */
-        usb_endpoint_table[0].DeviceDescBank[0].PCKSIZE.bit.SIZE = 3;
-        /* Configure control IN Packet size to 64 bytes */
-        usb_endpoint_table[0].DeviceDescBank[1].PCKSIZE.bit.SIZE = 3;
-        /* Configure the data buffer address for control OUT */
-        usb_endpoint_table[0].DeviceDescBank[0].ADDR.reg = (uint32_t)&ctrlOutCache.buf;
-        /* Configure the data buffer address for control IN */
-        usb_endpoint_table[0].DeviceDescBank[1].ADDR.reg = (uint32_t)&endpointCache[0].buf;
-        /* Set Multipacket size to 8 for control OUT and byte count to 0*/
-        usb_endpoint_table[0].DeviceDescBank[0].PCKSIZE.bit.MULTI_PACKET_SIZE = 8;
-        usb_endpoint_table[0].DeviceDescBank[0].PCKSIZE.bit.BYTE_COUNT = 0;
-        USB->DEVICE.DeviceEndpoint[0].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK0RDY;
-
-        // Reset current configuration value to 0
-        currentConfiguration = 0;
-    } else if (USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_RXSTP) {
+        usb_bus_reset();
+        usb_post_event(USB_EVENT_RESET, 0);
+    }
+
+    uint32_t summary = USB->DEVICE.EPINTSMRY.reg;
+
+    if (USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_RXSTP)
         AT91F_CDC_Enumerate();
+
+    for (uint32_t ep = 1; ep < MAX_EP; ++ep) {
+        if (!(summary & (1 << ep)))
+            continue;
+        // the flag is left for USB_ReadCore(), which enables the interrupt again
+        // with the next read
+        if (USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg &
+            USB->DEVICE.DeviceEndpoint[ep].EPINTENSET.reg & USB_DEVICE_EPINTFLAG_TRCPT0) {
+            USB->DEVICE.DeviceEndpoint[ep].EPINTENCLR.reg = USB_DEVICE_EPINTENCLR_TRCPT0;
+            usb_post_event(USB_EVENT_OUT, ep);
+        }
+    }
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    USB_IsConfigured
+//* \brief Test if the device is configured
+//*----------------------------------------------------------------------------
+bool USB_Ok() {
+    if (!usb_irq_enabled) {
+        timerTick();
+        USB_Handler();
     }
 
     return currentConfiguration != 0;
@@ -596,7 +699,8 @@ uint32_t USB_ReadCore(void *pData, uint32_t length, uint32_t ep, PacketBuffer *c
 #if USE_HID || USE_WEBUSB
         assert(ep != USB_EP_HID && ep != USB_EP_WEB);
 #endif
-        timerTick();
+        if (!usb_irq_enabled)
+            timerTick();
     }
 
     if (cache->ptr < cache->size) {
@@ -617,6 +721,8 @@ uint32_t USB_ReadCore(void *pData, uint32_t length, uint32_t ep, PacketBuffer *c
         epdesc->DeviceDescBank[0].PCKSIZE.bit.MULTI_PACKET_SIZE = 0;
         /* Start the reception by clearing the bank 0 ready bit */
         USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.bit.BK0RDY = true;
+        /* Wake up the main loop when the packet is in */
+        USB->DEVICE.DeviceEndpoint[ep].EPINTENSET.reg = USB_DEVICE_EPINTENSET_TRCPT0;
         /* set the user flag */
         cache->read_job = true;
     }
@@ -625,6 +731,8 @@ uint32_t USB_ReadCore(void *pData, uint32_t length, uint32_t ep, PacketBuffer *c
     if (USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_TRCPT0) {
         /* Set packet size */
         cache->size = epdesc->DeviceDescBank[0].PCKSIZE.bit.BYTE_COUNT;
+        USB_STATS_ADD(ep[ep].rx_packets, 1);
+        USB_STATS_ADD(ep[ep].rx_bytes, cache->size);
 
         // this is when processing a hand-over
         if (cache->read_job == 2) {
@@ -656,6 +764,7 @@ uint32_t USB_Read(void *pData, uint32_t length, uint32_t ep) {
 }
 
 void USB_ReadBlocking(void *dst, uint32_t length, uint32_t ep, PacketBuffer *cache) {
+    uint32_t start = usb_stats_now();
     /* Blocking read till specified number of bytes is received */
     while (length) {
         uint32_t curr = USB_ReadCore(dst, length, ep, cache);
@@ -664,13 +773,66 @@ void USB_ReadBlocking(void *dst, uint32_t length, uint32_t ep, PacketBuffer *cac
         length -= curr;
         dst = (char *)dst + curr;
     }
+    usb_stats_waited(ep, start);
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    USB_ReadMulti
+//* \brief Receive a whole transfer straight into dst, one completion for all
+//*        of its packets
+//*----------------------------------------------------------------------------
+uint32_t USB_ReadMulti(void *dst, uint32_t length, uint32_t ep) {
+    PacketBuffer *cache = &endpointCache[ep];
+    UsbDeviceDescriptor *epdesc = (UsbDeviceDescriptor *)USB->HOST.DESCADD.reg + ep;
+    uint32_t packet = 1 << (epdesc->DeviceDescBank[0].PCKSIZE.bit.SIZE + 3);
+
+    // the controller writes whole packets to a word aligned RAM address; also
+    // whatever is already in or on the way to the cache has to go first
+    if (((uint32_t)dst & 3) || length % packet || length > USB_MULTI_PACKET_MAX ||
+        cache->read_job || cache->ptr < cache->size) {
+        USB_ReadBlocking(dst, length, ep, 0);
+        return length;
+    }
+
+    epdesc->DeviceDescBank[0].ADDR.reg = (uint32_t)dst;
+    epdesc->DeviceDescBank[0].PCKSIZE.bit.BYTE_COUNT = 0;
+    epdesc->DeviceDescBank[0].PCKSIZE.bit.MULTI_PACKET_SIZE = length;
+    USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT0;
+    USB->DEVICE.DeviceEndpoint[ep].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK0RDY;
+
+    // TRCPT0 comes with the last packet, or with a short one
+    uint32_t start = usb_stats_now();
+    for (;;) {
+        __disable_irq();
+        if (USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_TRCPT0) {
+            __enable_irq();
+            break;
+        }
+        if (usb_irq_enabled) {
+            USB->DEVICE.DeviceEndpoint[ep].EPINTENSET.reg = USB_DEVICE_EPINTENSET_TRCPT0;
+            __WFI();
+        }
+        __enable_irq();
+        if (!USB_Ok()) {
+            // the bus reset has reconfigured the endpoint
+            return 0;
+        }
+    }
+
+    uint32_t size = epdesc->DeviceDescBank[0].PCKSIZE.bit.BYTE_COUNT;
+    USB->DEVICE.DeviceEndpoint[ep].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_TRCPT0;
+    cache->ptr = cache->size = 0;
+    usb_stats_waited(ep, start);
+    USB_STATS_ADD(ep[ep].rx_packets, (size + packet - 1) / packet);
+    USB_STATS_ADD(ep[ep].rx_bytes, size);
+    return size;
 }
 
 uint32_t USB_Write(const void *pData, uint32_t length, uint8_t ep_num) {
     return USB_WriteCore(pData, length, ep_num, false);
 }
 
-uint32_t USB_WriteCore(const void *pData, uint32_t length, uint8_t ep_num, bool handoverMode) {
+static void USB_WriteStart(const void *pData, uint32_t length, uint8_t ep_num, bool handoverMode) {
     uint32_t data_address;
 
     UsbDeviceDescriptor *epdesc = (UsbDeviceDescriptor *)USB->HOST.DESCADD.reg + ep_num;
@@ -686,8 +848,14 @@ uint32_t USB_WriteCore(const void *pData, uint32_t length, uint8_t ep_num, bool
         // data must be in RAM!
         assert(data_address >= HMCRAMC0_ADDR);
 
-        // always disable AUTO_ZLP on MSC channel, otherwise enable
+        // always disable AUTO_ZLP on MSC channel, otherwise enable; HF2 packets
+        // on the bulk channel carry their own length
+#if USE_WEBUSB
+        epdesc->DeviceDescBank[1].PCKSIZE.bit.AUTO_ZLP =
+            ep_num == USB_EP_MSC_IN || ep_num == USB_EP_WEB ? false : true;
+#else
         epdesc->DeviceDescBank[1].PCKSIZE.bit.AUTO_ZLP = ep_num == USB_EP_MSC_IN ? false : true;
+#endif
     } else {
         /* Copy to local buffer */
         memcpy(endpointCache[ep_num].buf, pData, length);
@@ -707,15 +875,65 @@ uint32_t USB_WriteCore(const void *pData, uint32_t length, uint8_t ep_num, bool
     /* Set the bank as ready */
     USB->DEVICE.DeviceEndpoint[ep_num].EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK1RDY;
 
+#if USE_USB_STATS
+    uint32_t packet = 1 << (epdesc->DeviceDescBank[1].PCKSIZE.bit.SIZE + 3);
+    USB_STATS_ADD(ep[ep_num].tx_packets, length ? (length + packet - 1) / packet : 1);
+    USB_STATS_ADD(ep[ep_num].tx_bytes, length);
+#endif
+}
+
+uint32_t USB_WriteCore(const void *pData, uint32_t length, uint8_t ep_num, bool handoverMode) {
+    // the bank may still be busy with a USB_WriteSubmit()
+    USB_WriteWait(ep_num);
+
+    USB_WriteStart(pData, length, ep_num, handoverMode);
+
     /* Wait for transfer to complete */
+    uint32_t start = usb_stats_now();
     while (!(USB->DEVICE.DeviceEndpoint[ep_num].EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_TRCPT1)) {
         // if (ep_num && !USB_Ok())
         //    return -1;
     }
+    usb_stats_waited(ep_num, start);
 
     return length;
 }
 
+//*----------------------------------------------------------------------------
+//* \fn    USB_WriteSubmit
+//* \brief Start an IN transfer and return right away; the data has to stay
+//*        put until USB_WriteDone()
+//*----------------------------------------------------------------------------
+void USB_WriteSubmit(const void *pData, uint32_t length, uint8_t ep_num) {
+    USB_WriteWait(ep_num);
+    // (anything shorter than a packet is copied to the endpoint cache)
+    USB_WriteStart(pData, length, ep_num, false);
+    writesInFlight |= 1 << ep_num;
+}
+
+bool USB_WriteDone(uint8_t ep_num) {
+    if (!(writesInFlight & (1 << ep_num)))
+        return true;
+    if (!(USB->DEVICE.DeviceEndpoint[ep_num].EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_TRCPT1))
+        return false;
+    writesInFlight &= ~(1 << ep_num);
+    return true;
+}
+
+bool USB_WriteWait(uint8_t ep_num) {
+    uint32_t start = usb_stats_now();
+    while (!USB_WriteDone(ep_num)) {
+        if (!USB_Ok()) {
+            // the bus reset has dropped whatever was in the bank
+            writesInFlight &= ~(1 << ep_num);
+            return false;
+        }
+    }
+    usb_stats_waited(ep_num, start);
+    return true;
+}
+
+
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_USB_SendZlp
 //* \brief Send zero length packet through the control endpoint
@@ -726,6 +944,10 @@ void AT91F_USB_SendZlp(void) {
 }
 
 static void configureInOut(uint8_t in_ep) {
+    // a read armed before the bus reset is gone
+    endpointCache[in_ep + 1].read_job = false;
+    endpointCache[in_ep + 1].ptr = endpointCache[in_ep + 1].size = 0;
+
     /* Configure BULK OUT endpoint for CDC Data interface*/
     USB->DEVICE.DeviceEndpoint[in_ep + 1].EPCFG.reg = USB_DEVICE_EPCFG_EPTYPE0(3);
     /* Set maximum packet size as 64 bytes */
@@ -758,6 +980,7 @@ void AT91F_CDC_Enumerate() {
 
     /* Clear the Received Setup flag */
     USB->DEVICE.DeviceEndpoint[0].EPINTFLAG.reg = USB_DEVICE_EPINTFLAG_RXSTP;
+    USB_STATS_ADD(setups, 1);
 
     /* Read the USB request parameters */
     bmRequestType = ctrlOutCache.buf[0];
@@ -876,9 +1099,9 @@ void AT91F_CDC_Enumerate() {
 #endif
 
 #if USE_WEBUSB
-        /* Configure INTERRUPT IN/OUT endpoint for HID interface*/
+        /* Configure BULK IN/OUT endpoint for the WebUSB interface */
         USB->DEVICE.DeviceEndpoint[USB_EP_WEB].EPCFG.reg =
-            USB_DEVICE_EPCFG_EPTYPE0(4) | USB_DEVICE_EPCFG_EPTYPE1(4);
+            USB_DEVICE_EPCFG_EPTYPE0(3) | USB_DEVICE_EPCFG_EPTYPE1(3);
 
         USB->DEVICE.DeviceEndpoint[USB_EP_WEB].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSSET_BK0RDY;
         USB->DEVICE.DeviceEndpoint[USB_EP_WEB].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK1RDY;
@@ -886,11 +1109,23 @@ void AT91F_CDC_Enumerate() {
         usb_endpoint_table[USB_EP_WEB].DeviceDescBank[1].PCKSIZE.bit.SIZE = 3;
 #endif
 
+#if USE_FPGA_REGS
+        /* Configure BULK IN/OUT endpoint for the FPGA register interface */
+        USB->DEVICE.DeviceEndpoint[USB_EP_FPGA].EPCFG.reg =
+            USB_DEVICE_EPCFG_EPTYPE0(3) | USB_DEVICE_EPCFG_EPTYPE1(3);
+
+        USB->DEVICE.DeviceEndpoint[USB_EP_FPGA].EPSTATUSSET.reg = USB_DEVICE_EPSTATUSSET_BK0RDY;
+        USB->DEVICE.DeviceEndpoint[USB_EP_FPGA].EPSTATUSCLR.reg = USB_DEVICE_EPSTATUSCLR_BK1RDY;
+        usb_endpoint_table[USB_EP_FPGA].DeviceDescBank[0].PCKSIZE.bit.SIZE = 3;
+        usb_endpoint_table[USB_EP_FPGA].DeviceDescBank[1].PCKSIZE.bit.SIZE = 3;
+#endif
+
+        usb_post_event(USB_EVENT_CONFIGURED, 0);
         break;
 
     case STD_GET_CONFIGURATION:
         /* Return current configuration value */
-        sendCtrl(&(currentConfiguration), sizeof(currentConfiguration));
+        sendCtrl((const void *)&currentConfiguration, sizeof(currentConfiguration));
         break;
 
     case STD_GET_STATUS_ZERO:
@@ -1073,6 +1308,7 @@ void reset_ep(uint8_t ep) {
 
 void stall_ep(uint8_t ep) {
     logval("Stall EP", ep);
+    USB_STATS_ADD(ep[ep & 0xf].stalls, 1);
     /* Check the direction */
     if (ep == 0 || isInEP(ep)) {
         /* Set STALL request on IN direction */
@@ -1090,6 +1326,9 @@ void usb_init(void) {
 #if USE_CDC
     pCdc.currentConnection = 0;
 #endif
+    USB->DEVICE.INTENSET.reg = USB_DEVICE_INTENSET_EORST;
+    usb_irq_enabled = true;
+    NVIC_EnableIRQ(USB_IRQn);
     USB->HOST.CTRLA.bit.ENABLE = true;
 }
 
@@ -0,0 +1,330 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * External SPI flash holding the FPGA bitstream
+ */
+
+#include "uf2.h"
+
+#ifdef BOARD_FLASH_CS_PIN
+
+#define BLOCK_32K_SIZE (32 * 1024)
+#define BLOCK_64K_SIZE (64 * 1024)
+#define NUM_SECTORS (SPI_FLASH_MAX_SIZE / SPI_FLASH_SECTOR_SIZE)
+
+// Recently read 512 byte sectors, so that hosts re-reading the same directory
+// and FAT sectors over and over are served from RAM; evicts the least
+// recently used entry. Every write below invalidates what it overlaps.
+#define CACHE_SECTOR_SIZE 512
+
+typedef struct {
+    bool valid;
+    uint32_t addr;
+    uint32_t last_used;
+    uint8_t data[CACHE_SECTOR_SIZE];
+} CachedSector;
+
+static CachedSector cache[BOARD_FLASH_CACHE_SECTORS];
+static uint32_t cache_clock;
+uint32_t ext_flash_cache_hits, ext_flash_cache_misses;
+
+static void cache_invalidate(uint32_t addr, uint32_t size) {
+    for (int i = 0; i < BOARD_FLASH_CACHE_SECTORS; ++i)
+        if (cache[i].addr < addr + size && addr < cache[i].addr + CACHE_SECTOR_SIZE)
+            cache[i].valid = false;
+}
+
+void ext_flash_invalidate_cache(void) {
+    for (int i = 0; i < BOARD_FLASH_CACHE_SECTORS; ++i)
+        cache[i].valid = false;
+}
+
+// One bit per 4K sector erased since the start of the current transfer.
+static uint32_t erased[NUM_SECTORS / 32];
+// Same for sectors that were already blank when the transfer first touched them.
+static uint32_t blank[NUM_SECTORS / 32];
+
+// Pages of the sector not yet programmed in this transfer are known to be blank.
+static bool is_blank_sector(uint32_t sector) {
+    return (erased[sector / 32] | blank[sector / 32]) & (1 << (sector % 32));
+}
+
+// True if none of the sectors in [addr, addr + size) was erased or found
+// blank yet; either way they may hold data of this transfer by now.
+static bool none_erased(uint32_t addr, uint32_t size) {
+    for (uint32_t s = addr / SPI_FLASH_SECTOR_SIZE; s < (addr + size) / SPI_FLASH_SECTOR_SIZE; ++s)
+        if (is_blank_sector(s))
+            return false;
+    return true;
+}
+
+static void erase(uint8_t command, uint32_t addr, uint32_t size) {
+    spi_flash_command(CMD_ENABLE_WRITE);
+    spi_flash_sector_command(command, addr);
+    cache_invalidate(addr, size);
+    for (uint32_t s = addr / SPI_FLASH_SECTOR_SIZE; s < (addr + size) / SPI_FLASH_SECTOR_SIZE; ++s)
+        erased[s / 32] |= 1 << (s % 32);
+}
+
+// Erase the unit holding addr using the largest erase that only touches
+// [addr, end), i.e. pages this upload is going to write anyway.
+static void plan_erase(uint32_t addr, uint32_t end) {
+    if (end > SPI_FLASH_MAX_SIZE)
+        end = SPI_FLASH_MAX_SIZE;
+
+    if (!(addr & (BLOCK_64K_SIZE - 1)) && addr + BLOCK_64K_SIZE <= end &&
+        none_erased(addr, BLOCK_64K_SIZE))
+        erase(CMD_BLOCK_ERASE_64K, addr, BLOCK_64K_SIZE);
+    else if (!(addr & (BLOCK_32K_SIZE - 1)) && addr + BLOCK_32K_SIZE <= end &&
+             none_erased(addr, BLOCK_32K_SIZE))
+        erase(CMD_BLOCK_ERASE_32K, addr, BLOCK_32K_SIZE);
+    else
+        erase(CMD_SECTOR_ERASE, addr & ~(SPI_FLASH_SECTOR_SIZE - 1), SPI_FLASH_SECTOR_SIZE);
+}
+
+// Pages waiting to be programmed. write_block() only has to wait when all of
+// them are taken; otherwise it returns right away and the next USB block is
+// received while the flash is still busy with an erase or page program.
+#define PAGE_QUEUE_SIZE 4
+
+typedef struct {
+    uint32_t addr;
+    uint8_t data[SPI_FLASH_PAGE_SIZE];
+} QueuedPage;
+
+static QueuedPage page_queue[PAGE_QUEUE_SIZE];
+static uint8_t queue_head, queue_len;
+// an erase or page program was issued and the WIP bit may still be set
+static bool flash_busy;
+
+void ext_flash_process(void) {
+    if (flash_busy) {
+        if (spi_flash_is_busy())
+            return;
+        flash_busy = false;
+    }
+
+    if (!queue_len)
+        return;
+
+    QueuedPage *page = &page_queue[queue_head];
+    spi_flash_command(CMD_ENABLE_WRITE);
+    // the page is copied out, so the slot can be reused right away
+    spi_flash_write_data_async(page->addr, page->data, SPI_FLASH_PAGE_SIZE, NULL);
+    queue_head = (queue_head + 1) % PAGE_QUEUE_SIZE;
+    queue_len--;
+    flash_busy = true;
+}
+
+static void drain_queue(void) {
+    while (queue_len || flash_busy)
+        ext_flash_process();
+}
+
+static bool is_blank(const uint8_t *src) {
+    for (int i = 0; i < SPI_FLASH_PAGE_SIZE; ++i)
+        if (src[i] != 0xff)
+            return false;
+    return true;
+}
+
+// Contents of the sector pages are being written to, read once when the first
+// of them comes along and kept in step with what is queued for it. Its pages
+// are compared here, so they can be queued without waiting for the flash.
+static uint8_t sector_buffer[SPI_FLASH_SECTOR_SIZE];
+#define NO_SECTOR 0xffffffff
+static uint32_t buffered_sector = NO_SECTOR;
+
+static void load_sector(uint32_t sector) {
+    drain_queue();
+    spi_flash_read_data(sector, sector_buffer, SPI_FLASH_SECTOR_SIZE);
+    buffered_sector = sector;
+
+    for (uint32_t i = 0; i < SPI_FLASH_SECTOR_SIZE; i += SPI_FLASH_PAGE_SIZE)
+        if (!is_blank(sector_buffer + i))
+            return;
+    uint32_t s = sector / SPI_FLASH_SECTOR_SIZE;
+    blank[s / 32] |= 1 << (s % 32);
+}
+
+// Erase the sector and put back the pages outside [addr, end), leaving the
+// rest erased for the incoming data.
+static void rewrite_sector(uint32_t sector, uint32_t addr, uint32_t end) {
+    if (sector != buffered_sector)
+        load_sector(sector);
+    drain_queue();
+    erase(CMD_SECTOR_ERASE, sector, SPI_FLASH_SECTOR_SIZE);
+    flash_busy = true;
+    for (uint32_t page = sector; page < sector + SPI_FLASH_SECTOR_SIZE; page += SPI_FLASH_PAGE_SIZE)
+        if (page < addr || page >= end)
+            ext_flash_write_page(page, sector_buffer + (page - sector), 0);
+        else
+            memset(sector_buffer + (page - sector), 0xff, SPI_FLASH_PAGE_SIZE);
+    // Only [addr, end) is blank now; further pages of the sector have to be
+    // compared with what was put back.
+    erased[sector / SPI_FLASH_SECTOR_SIZE / 32] &= ~(1 << (sector / SPI_FLASH_SECTOR_SIZE % 32));
+}
+
+enum { PAGE_SAME, PAGE_PROGRAMMABLE, PAGE_DIFFERENT };
+
+// Programming can only clear bits; anything else needs an erase.
+static int compare_page(const uint8_t *old, const uint8_t *src) {
+    int res = PAGE_SAME;
+    for (int i = 0; i < SPI_FLASH_PAGE_SIZE; ++i) {
+        if ((old[i] & src[i]) != src[i])
+            return PAGE_DIFFERENT;
+        if (old[i] != src[i])
+            res = PAGE_PROGRAMMABLE;
+    }
+    return res;
+}
+
+// the last sector compared needed an erase; most likely the next one will too
+static bool erase_streak;
+
+void ext_flash_write_page(uint32_t addr, uint8_t *src, uint32_t end) {
+    uint32_t sector = addr & ~(SPI_FLASH_SECTOR_SIZE - 1);
+
+    // Until the sector is erased, see what's there: re-flashing a bitstream
+    // usually leaves most of it unchanged.
+    if (!is_blank_sector(sector / SPI_FLASH_SECTOR_SIZE) && sector != buffered_sector)
+        load_sector(sector);
+
+    if (is_blank_sector(sector / SPI_FLASH_SECTOR_SIZE)) {
+        // the erase already left it that way
+        if (is_blank(src))
+            return;
+    } else {
+        switch (compare_page(sector_buffer + (addr - sector), src)) {
+        case PAGE_SAME:
+            erase_streak = false;
+            return;
+        case PAGE_PROGRAMMABLE:
+            // typically onto a blank page; no erase needed
+            break;
+        default:
+            if (addr != sector || end < sector + SPI_FLASH_SECTOR_SIZE) {
+                // earlier pages of the sector may have been skipped above
+                rewrite_sector(sector, addr, end);
+            } else {
+                // no block erases until the content keeps changing; the
+                // following sectors may still match
+                plan_erase(addr, erase_streak ? end : sector + SPI_FLASH_SECTOR_SIZE);
+                flash_busy = true;
+            }
+            erase_streak = true;
+            if (is_blank(src))
+                return;
+            break;
+        }
+    }
+
+    while (queue_len == PAGE_QUEUE_SIZE)
+        ext_flash_process();
+
+    QueuedPage *page = &page_queue[(queue_head + queue_len) % PAGE_QUEUE_SIZE];
+    page->addr = addr;
+    memcpy(page->data, src, SPI_FLASH_PAGE_SIZE);
+    queue_len++;
+    if (sector == buffered_sector && src != sector_buffer + (addr - sector))
+        memcpy(sector_buffer + (addr - sector), src, SPI_FLASH_PAGE_SIZE);
+    cache_invalidate(addr, SPI_FLASH_PAGE_SIZE);
+
+    ext_flash_process();
+}
+
+uint32_t ext_flash_crc32(uint32_t addr, uint32_t len) {
+    // pages still in the queue are part of what the host expects
+    drain_queue();
+    if (addr > spi_flash_size())
+        addr = spi_flash_size();
+    if (len > spi_flash_size() - addr)
+        len = spi_flash_size() - addr;
+    return spi_flash_crc32(addr, len);
+}
+
+// Program a page directly, outside of any erase session.
+static void program_page(uint32_t addr, uint8_t *src) {
+    spi_flash_wait_ready();
+    spi_flash_command(CMD_ENABLE_WRITE);
+    spi_flash_write_data(addr, src, SPI_FLASH_PAGE_SIZE);
+    spi_flash_wait_ready();
+    cache_invalidate(addr, SPI_FLASH_PAGE_SIZE);
+}
+
+void ext_flash_replace_page(uint32_t addr, uint8_t *src) {
+    drain_queue();
+    if ((addr & ~(SPI_FLASH_SECTOR_SIZE - 1)) == buffered_sector)
+        buffered_sector = NO_SECTOR;
+    spi_flash_wait_ready();
+    spi_flash_command(CMD_ENABLE_WRITE);
+    spi_flash_sector_command(CMD_SECTOR_ERASE, addr & ~(SPI_FLASH_SECTOR_SIZE - 1));
+    cache_invalidate(addr & ~(SPI_FLASH_SECTOR_SIZE - 1), SPI_FLASH_SECTOR_SIZE);
+    program_page(addr, src);
+}
+
+void ext_flash_read_sector(uint32_t addr, uint8_t *dst) {
+    CachedSector *victim = &cache[0];
+
+    cache_clock++;
+    for (int i = 0; i < BOARD_FLASH_CACHE_SECTORS; ++i) {
+        CachedSector *c = &cache[i];
+        if (c->valid && c->addr == addr) {
+            ext_flash_cache_hits++;
+            c->last_used = cache_clock;
+            memcpy(dst, c->data, CACHE_SECTOR_SIZE);
+            return;
+        }
+        if (!c->valid || (victim->valid && c->last_used < victim->last_used))
+            victim = c;
+    }
+
+    ext_flash_cache_misses++;
+    // the flash can't be read while it's programming
+    drain_queue();
+    spi_flash_read_data(addr, victim->data, CACHE_SECTOR_SIZE);
+    victim->valid = true;
+    victim->addr = addr;
+    victim->last_used = cache_clock;
+    memcpy(dst, victim->data, CACHE_SECTOR_SIZE);
+}
+
+void ext_flash_flush(void) {
+    drain_queue();
+    // the next transfer starts a new session
+    memset(erased, 0, sizeof(erased));
+    memset(blank, 0, sizeof(blank));
+    buffered_sector = NO_SECTOR;
+    erase_streak = false;
+}
+
+#if USE_FLASH_LUN
+void ext_flash_write_block(uint32_t addr, uint8_t *src, uint32_t end) {
+    for (uint32_t i = 0; i < UDI_MSC_BLOCK_SIZE; i += SPI_FLASH_PAGE_SIZE)
+        ext_flash_write_page(addr + i, src + i, end);
+}
+#endif
+
+#endif
@@ -76,6 +76,16 @@ static const struct TextFile info[] = {
     {.name = "INFO_UF2TXT", .content = infoUf2File},
 #if USE_INDEX_HTM
     {.name = "INDEX   HTM", .content = indexFile},
+#endif
+#ifdef BOARD_FPGA_CRESET_PIN
+    {.name = "FPGA    TXT", .content = fpgaStatusFile},
+#endif
+#ifdef BOARD_JTAG_TCK_PIN
+    {.name = "JTAG    TXT", .content = jtagStatusFile},
+#endif
+#if USE_USB_STATS
+    // keep this one right before CURRENT.UF2; see STATS_TXT_SECTOR
+    {.name = "STATS   TXT", .content = usbStatsFile},
 #endif
     {.name = "CURRENT UF2"},
 };
@@ -85,6 +95,12 @@ static const struct TextFile info[] = {
 #define UF2_SECTORS (UF2_SIZE / 512)
 #define UF2_FIRST_SECTOR (NUM_INFO + 1)
 #define UF2_LAST_SECTOR (UF2_FIRST_SECTOR + UF2_SECTORS - 1)
+
+#ifdef BOARD_FPGA_CRESET_PIN
+// FPGA.BIT, the bitstream in the active slot, follows CURRENT.UF2
+#define FPGA_BIT_SECTORS ((FPGA_SLOT_SIZE - FPGA_SLOT_HEADER_SIZE + 511) / 512)
+#define FPGA_BIT_FIRST_SECTOR (UF2_LAST_SECTOR + 1)
+#endif
 #endif
 
 #define RESERVED_SECTORS 1
@@ -96,6 +112,10 @@ static const struct TextFile info[] = {
 #define START_ROOTDIR (START_FAT1 + SECTORS_PER_FAT)
 #define START_CLUSTERS (START_ROOTDIR + ROOT_DIR_SECTORS)
 
+#if USE_FAT && USE_USB_STATS
+#define STATS_TXT_SECTOR (START_CLUSTERS + NUM_INFO - 2)
+#endif
+
 static const FAT_BootBlock BootBlock = {
     .JumpInstruction = {0xeb, 0x3c, 0x90},
     .OEMInfo = "UF2 UF2 ",
@@ -129,6 +149,17 @@ void read_block(uint32_t block_no, uint8_t *data) {
     memset(data, 0, 512);
     uint32_t sectionIdx = block_no;
 
+#ifdef BOARD_FPGA_CRESET_PIN
+    // CDONE may have gone high since FPGA.TXT was written
+    fpga_update_status();
+#endif
+
+#ifdef STATS_TXT_SECTOR
+    // only when it is looked at; the directory needs the file's size
+    if (block_no == START_ROOTDIR || block_no == STATS_TXT_SECTOR)
+        usb_stats_update_file();
+#endif
+
     if (block_no == 0) {
         memcpy(data, &BootBlock, sizeof(BootBlock));
         data[510] = 0x55;
@@ -146,10 +177,18 @@ void read_block(uint32_t block_no, uint8_t *data) {
                 data[i] = 0xff;
             }
         }
+#ifdef BOARD_FPGA_CRESET_PIN
+        uint32_t fpgaLastSector =
+            FPGA_BIT_FIRST_SECTOR + (fpga_bitstream_size() + 511) / 512 - 1;
+#endif
         for (int i = 0; i < 256; ++i) {
             uint32_t v = sectionIdx * 256 + i;
             if (UF2_FIRST_SECTOR <= v && v <= UF2_LAST_SECTOR)
                 ((uint16_t *)(void *)data)[i] = v == UF2_LAST_SECTOR ? 0xffff : v + 1;
+#ifdef BOARD_FPGA_CRESET_PIN
+            if (FPGA_BIT_FIRST_SECTOR <= v && v <= fpgaLastSector)
+                ((uint16_t *)(void *)data)[i] = v == fpgaLastSector ? 0xffff : v + 1;
+#endif
         }
 #else
         if (sectionIdx == 0)
@@ -170,6 +209,12 @@ void read_block(uint32_t block_no, uint8_t *data) {
                 d->startCluster = i + 2;
                 padded_memcpy(d->name, inf->name, 11);
             }
+#ifdef BOARD_FPGA_CRESET_PIN
+            d++;
+            d->size = fpga_bitstream_size();
+            d->startCluster = d->size ? FPGA_BIT_FIRST_SECTOR : 0;
+            padded_memcpy(d->name, "FPGA    BIT", 11);
+#endif
         }
     } else {
         sectionIdx -= START_CLUSTERS;
@@ -189,30 +234,222 @@ void read_block(uint32_t block_no, uint8_t *data) {
                 bl->payloadSize = 256;
                 memcpy(bl->data, (void *)addr, bl->payloadSize);
             }
+#ifdef BOARD_FPGA_CRESET_PIN
+            else if (sectionIdx - UF2_SECTORS < FPGA_BIT_SECTORS) {
+                fpga_read_bitstream((sectionIdx - UF2_SECTORS) * 512, data);
+            }
+#endif
         }
     }
 #endif
 }
 
-void write_block(uint32_t block_no, uint8_t *data, bool quiet, WriteState *state) {
-    UF2_Block *bl = (void *)data;
-    if (!is_uf2_block(bl)) {
-        return;
+#ifdef BOARD_FLASH_CS_PIN
+// Check if the block is meant for the external SPI flash, either by family ID or by
+// address window, and if so compute the offset into the SPI flash.
+static bool spi_flash_target(UF2_Block *bl, uint32_t target, uint32_t *addr) {
+    if ((bl->flags & UF2_FLAG_FAMILYID_PRESENT) && bl->reserved == SPI_FLASH_FAMILY_ID)
+        *addr = target;
+    else if (target >= SPI_FLASH_UF2_BASE)
+        *addr = target - SPI_FLASH_UF2_BASE;
+    else
+        return false;
+
+#ifdef BOARD_FPGA_CRESET_PIN
+    if (!fpga_slot_addr_ok(*addr))
+        return false;
+#endif
+    return *addr < SPI_FLASH_MAX_SIZE && *addr < spi_flash_size();
+}
+#endif
+
+// Hands out the payload of a block in chunks of up to 256 bytes, decoding RLE
+// compressed blocks on the fly.
+typedef struct {
+    UF2_Block *bl;
+    uint32_t size;   // decoded payload size
+    uint32_t offset; // of the next chunk
+    // RLE state
+    const uint8_t *src, *src_end;
+    uint8_t run;     // bytes left in the current run
+    bool literal;
+    uint8_t value;
+} PayloadReader;
+
+static bool payload_init(PayloadReader *rd, UF2_Block *bl) {
+    memset(rd, 0, sizeof(*rd));
+    rd->bl = bl;
+    if (bl->payloadSize > sizeof(bl->data))
+        return false;
+    if (!(bl->flags & UF2_FLAG_RLE)) {
+        rd->size = bl->payloadSize;
+        return true;
     }
+    if (bl->payloadSize < 4)
+        return false;
+    memcpy(&rd->size, bl->data, 4);
+    rd->src = bl->data + 4;
+    rd->src_end = bl->data + bl->payloadSize;
+    return rd->size && !(rd->size & 0xff) && rd->size <= UF2_RLE_MAX_SIZE;
+}
 
-    if ((bl->flags & UF2_FLAG_NOFLASH) || bl->payloadSize != 256 || (bl->targetAddr & 0xff) ||
-        bl->targetAddr < APP_START_ADDRESS || bl->targetAddr >= FLASH_SIZE) {
+static bool rle_decode(PayloadReader *rd, uint8_t *dst, uint32_t len) {
+    while (len) {
+        if (!rd->run) {
+            if (rd->src + 2 > rd->src_end)
+                return false;
+            uint8_t c = *rd->src++;
+            rd->literal = c < 0x80;
+            rd->run = rd->literal ? c + 1 : c - 0x80 + 3;
+            if (!rd->literal)
+                rd->value = *rd->src++;
+        }
+        uint32_t n = rd->run < len ? rd->run : len;
+        if (rd->literal) {
+            if (rd->src + n > rd->src_end)
+                return false;
+            memcpy(dst, rd->src, n);
+            rd->src += n;
+        } else {
+            memset(dst, rd->value, n);
+        }
+        rd->run -= n;
+        dst += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Returns the size of the next chunk and points *ptr at it (either into the block
+// or at `page`); 0 at the end or on corrupt data.
+static uint32_t payload_next(PayloadReader *rd, uint8_t *page, uint8_t **ptr) {
+    uint32_t n = rd->size - rd->offset;
+    if (n > 256)
+        n = 256;
+    if (!n)
+        return 0;
+    if (rd->bl->flags & UF2_FLAG_RLE) {
+        if (!rle_decode(rd, page, n))
+            return 0;
+        *ptr = page;
+    } else {
+        *ptr = rd->bl->data + rd->offset;
+    }
+    rd->offset += n;
+    return n;
+}
+
+#ifdef BOARD_FLASH_CS_PIN
+// The UF2 file going to the external flash. Every file is its own erase session,
+// and the erase planner only looks past the current block while the blocks so
+// far followed each other without gaps.
+static struct {
+    uint32_t numBlocks;
+    uint32_t nextBlockNo;
+    uint32_t nextTarget;
+    bool contiguous;
+} ext_upload;
+
+static void ext_upload_block(UF2_Block *bl, uint32_t size) {
+    if (bl->blockNo == 0 || bl->numBlocks != ext_upload.numBlocks ||
+        bl->blockNo != ext_upload.nextBlockNo || bl->targetAddr != ext_upload.nextTarget) {
+        // a new file, or an interrupted or sparse one; sectors erased so far
+        // may already hold data that must not be programmed over
+        ext_flash_flush();
+        ext_upload.contiguous = bl->blockNo == 0;
+    }
+    ext_upload.numBlocks = bl->numBlocks;
+    ext_upload.nextBlockNo = bl->blockNo + 1;
+    ext_upload.nextTarget = bl->targetAddr + size;
+}
+#endif
+
+static void write_page(UF2_Block *bl, uint32_t target, uint8_t *data, uint32_t len,
+                       uint32_t remaining, bool quiet) {
+#ifdef BOARD_FLASH_CS_PIN
+    uint32_t ext_addr;
+    if (!(bl->flags & UF2_FLAG_NOFLASH) && len == 256 && !(target & 0xff) &&
+        spi_flash_target(bl, target, &ext_addr)) {
+        if (target == bl->targetAddr)
+            ext_upload_block(bl, remaining);
+        uint32_t end = ext_addr + remaining;
+        // while the file has no gaps, the rest of it most likely follows this page
+        if (ext_upload.contiguous && bl->blockNo < bl->numBlocks)
+            end += (bl->numBlocks - bl->blockNo - 1) * 256;
+        bitstream_write_page(ext_addr, data, end, bl->blockNo == 0 && target == bl->targetAddr);
+    } else
+#endif
+    if ((bl->flags & UF2_FLAG_NOFLASH) || len != 256 || (target & 0xff) ||
+        target < APP_START_ADDRESS || target >= FLASH_SIZE) {
 #if USE_DBG_MSC
         if (!quiet)
-            logval("invalid target addr", bl->targetAddr);
+            logval("invalid target addr", target);
 #endif
         // this happens when we're trying to re-flash CURRENT.UF2 file previously
         // copied from a device; we still want to count these blocks to reset properly
     } else {
-        // logval("write block at", bl->targetAddr);
-        flash_write_row((void *)bl->targetAddr, (void *)bl->data);
+        // logval("write block at", target);
+        flash_write_row((void *)target, (void *)data);
+    }
+}
+
+void write_block(uint32_t block_no, uint8_t *data, bool quiet, WriteState *state) {
+    UF2_Block *bl = (void *)data;
+    if (!is_uf2_block(bl)) {
+        return;
     }
 
+    PayloadReader rd;
+    uint8_t page[256];
+    uint8_t *ptr;
+    uint32_t len;
+    bool valid = payload_init(&rd, bl);
+
+#ifdef BOARD_JTAG_TCK_PIN
+    if ((bl->flags & UF2_FLAG_FAMILYID_PRESENT) && bl->reserved == JTAG_XSVF_FAMILY_ID) {
+        // played as it arrives, like an FPGA stream
+        if (valid && xsvf_begin_block(bl)) {
+            while ((len = payload_next(&rd, page, &ptr)))
+                xsvf_write(ptr, len);
+            xsvf_end_block(bl);
+        }
+        return;
+    }
+#endif
+
+#ifdef BOARD_FPGA_CRESET_PIN
+    if ((bl->flags & UF2_FLAG_FAMILYID_PRESENT) && bl->reserved == FPGA_STREAM_FAMILY_ID) {
+        // volatile configuration; nothing is stored, so don't count blocks towards a reset
+        if (valid && fpga_stream_begin_block(bl)) {
+            while ((len = payload_next(&rd, page, &ptr)))
+                fpga_stream_write(ptr, len);
+            fpga_stream_end_block(bl);
+        }
+        return;
+    }
+
+    if ((bl->flags & UF2_FLAG_FAMILYID_PRESENT) && bl->reserved == FPGA_CONTROL_FAMILY_ID) {
+        if (!fpga_control((FPGA_Control *)bl->data) && !quiet)
+            logval("FPGA control failed", ((FPGA_Control *)bl->data)->command);
+        valid = false; // nothing to write, but count it
+    }
+#endif
+
+    // uncompressed blocks are written as a single page
+    if (!(bl->flags & UF2_FLAG_RLE) && bl->payloadSize != 256)
+        valid = false;
+
+    if (valid) {
+        while ((len = payload_next(&rd, page, &ptr))) {
+            uint32_t offset = rd.offset - len;
+            write_page(bl, bl->targetAddr + offset, ptr, len, rd.size - offset, quiet);
+        }
+    }
+#if USE_DBG_MSC
+    else if (!quiet)
+        logval("invalid payload", bl->payloadSize);
+#endif
+
     if (state && bl->numBlocks) {
         if (state->numBlocks != bl->numBlocks) {
             if (bl->numBlocks >= MAX_BLOCKS || state->numBlocks)
@@ -229,6 +466,10 @@ void write_block(uint32_t block_no, uint8_t *data, bool quiet, WriteState *state
                 state->numWritten++;
             }
             if (state->numWritten >= state->numBlocks) {
+#ifdef BOARD_FLASH_CS_PIN
+                // make sure the last page has landed before we reset
+                ext_flash_flush();
+#endif
                 // wait a little bit before resetting, to avoid Windows transmit error
                 // https://github.com/Microsoft/uf2-samd21/issues/11
                 if (!quiet)
@@ -0,0 +1,566 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * FPGA configuration port (iCE40 style slave SPI with CRESET and CDONE)
+ */
+
+#include "uf2.h"
+
+#ifdef BOARD_FPGA_CRESET_PIN
+
+#ifndef BOARD_FLASH_CS_PIN
+#error "the FPGA configuration port uses the SPI bus of the external flash"
+#endif
+
+// iCE40 slave SPI configuration timing (TN1248)
+#define CRESET_LOW_US 1      // >= 200ns
+#define CRESET_CLEAR_US 1200 // configuration memory clear
+#define TRAILING_CLOCKS 7    // >= 49 clocks after the last bitstream byte
+
+#define BOOT_TIMEOUT_MS 500
+
+enum { STREAM_IDLE, STREAM_ACTIVE };
+
+static uint8_t stream_state;
+static uint32_t stream_next_block;
+static uint32_t stream_bytes;
+static uint32_t stream_received; // including what was skipped
+static uint32_t stream_skip;     // file header still to drop
+static uint32_t stream_left;     // configuration data still to send
+
+// first line of FPGA.TXT; the slot list follows
+static char status_line[48];
+static FPGA_SlotHeader slots[FPGA_NUM_SLOTS];
+static int active_slot = -1;
+
+static uint32_t slot_addr(uint32_t slot) {
+    return FPGA_SLOT_BASE + slot * FPGA_SLOT_SIZE;
+}
+
+static uint32_t bitstream_addr(uint32_t slot) {
+    return slot_addr(slot) + FPGA_SLOT_HEADER_SIZE;
+}
+
+// Smaller flash parts only have room for the first few slots.
+static bool slot_fits(uint32_t slot) {
+    return slot < FPGA_NUM_SLOTS && slot_addr(slot) + FPGA_SLOT_SIZE <= spi_flash_size();
+}
+
+bool fpga_slot_addr_ok(uint32_t addr) {
+    if (addr < FPGA_SLOT_BASE || addr >= FPGA_SLOT_BASE + FPGA_NUM_SLOTS * FPGA_SLOT_SIZE)
+        return true;
+    return slot_fits((addr - FPGA_SLOT_BASE) / FPGA_SLOT_SIZE);
+}
+
+// Configuration supervisor. config_begin() is called right after CRESET goes
+// high; the EIC timestamps the rising edge of CDONE from its interrupt, and
+// config_check() files the result the next time anyone looks.
+static FPGA_ConfigStats config_stats;
+static bool config_pending;
+static uint32_t config_start; // cpu_cycles()
+static volatile bool cdone_seen;
+static volatile uint32_t cdone_at;
+
+// it has to fit in the one cluster of FPGA.TXT
+char fpgaStatusFile[512];
+
+// Rough busy wait; the SPI clock and CRESET timings have plenty of margin.
+static void delay_us(uint32_t us) {
+    for (uint32_t i = us * (CPU_FREQUENCY / 1000000) / 4; i; --i)
+        asm("nop");
+}
+
+// Text past the end of fpgaStatusFile is dropped; room is left for the final
+// line break and the terminating zero.
+static char *append(char *p, const char *str) {
+    while (*str && p < fpgaStatusFile + sizeof(fpgaStatusFile) - 3)
+        *p++ = *str++;
+    return p;
+}
+
+static char *append_hex(char *p, const char *label, uint32_t n) {
+    char num[9];
+    num[writeNum(num, n, false)] = 0;
+    p = append(p, label);
+    p = append(p, "0x");
+    return append(p, num);
+}
+
+static const char *config_source_name(uint32_t source) {
+    switch (source) {
+    case FPGA_CONFIG_POWER_ON:
+        return "power-on";
+    case FPGA_CONFIG_FLASH:
+        return "flash";
+    case FPGA_CONFIG_STREAM:
+        return "stream";
+    }
+    return "?";
+}
+
+static void update_file(void) {
+    FPGA_ConfigStats *st = &config_stats;
+    char *p = append(fpgaStatusFile, status_line);
+
+    p = append_hex(p, "Configs ", st->configs);
+    p = append_hex(p, " fails ", st->failures);
+    if (st->configs > st->failures) {
+        p = append_hex(p, "; us last ", st->last_us);
+        p = append_hex(p, " min ", st->min_us);
+        p = append_hex(p, " max ", st->max_us);
+        p = append_hex(p, " avg ", st->total_us / (st->configs - st->failures));
+    }
+    p = append(p, "\r\n");
+    // the full history is in HF2_CMD_FPGA_STATUS
+    for (uint32_t i = 0; i < st->num_records && i < 2; ++i) {
+        FPGA_ConfigRecord *r = &st->records[i];
+        p = append(p, config_source_name(r->source));
+        p = append_hex(p, " at ms ", r->time_ms);
+        if (i == 0 && config_pending)
+            p = append(p, ": waiting for CDONE");
+        else
+            p = append_hex(p, r->done ? ": done in us " : ": failed after us ", r->duration_us);
+        p = append(p, "\r\n");
+    }
+
+    for (int i = 0; i < FPGA_NUM_SLOTS; ++i) {
+        if (!slot_fits(i))
+            continue;
+        p = append_hex(p, "Slot ", i);
+        if (slots[i].magic == FPGA_SLOT_MAGIC) {
+            p = append_hex(p, ": version ", slots[i].version);
+            p = append_hex(p, " length ", slots[i].length);
+            p = append_hex(p, " crc ", slots[i].crc32);
+        } else {
+            p = append(p, ": empty");
+        }
+        if (i == active_slot)
+            p = append(p, " (active)");
+        p = append(p, "\r\n");
+    }
+    *p = 0;
+}
+
+static void set_status(const char *msg, bool show_bytes) {
+    char *p = status_line;
+    // leave room for the byte count
+    while (*msg && p < status_line + sizeof(status_line) - 16)
+        *p++ = *msg++;
+    if (show_bytes) {
+        *p++ = ' ';
+        *p++ = '0';
+        *p++ = 'x';
+        p += writeNum(p, stream_bytes, false);
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = 0;
+    update_file();
+}
+
+#ifdef BOARD_FPGA_CDONE_EXTINT
+#define CDONE_EXTINT_MASK (1 << BOARD_FPGA_CDONE_EXTINT)
+
+void EIC_Handler(void) {
+    cdone_at = cpu_cycles();
+    EIC->INTENCLR.reg = CDONE_EXTINT_MASK;
+    EIC->INTFLAG.reg = CDONE_EXTINT_MASK;
+    cdone_seen = true;
+}
+
+static void cdone_init(void) {
+    uint32_t pin = BOARD_FPGA_CDONE_PINMUX >> 16;
+    PORT->Group[pin / 32].PINCFG[pin % 32].bit.PMUXEN = 1;
+    PORT->Group[pin / 32].PMUX[(pin % 32) / 2].reg &= ~(0xF << (4 * (pin & 0x01u)));
+    PORT->Group[pin / 32].PMUX[(pin % 32) / 2].reg |=
+        (BOARD_FPGA_CDONE_PINMUX & 0xFF) << (4 * (pin & 0x01u));
+
+    PM->APBAMASK.reg |= PM_APBAMASK_EIC;
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_EIC | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+    EIC->CONFIG[BOARD_FPGA_CDONE_EXTINT / 8].reg |= EIC_CONFIG_SENSE0_RISE
+                                                     << (4 * (BOARD_FPGA_CDONE_EXTINT % 8));
+    EIC->CTRL.reg = EIC_CTRL_ENABLE;
+    while (EIC->STATUS.bit.SYNCBUSY)
+        ;
+    NVIC_EnableIRQ(EIC_IRQn);
+}
+
+static void cdone_arm(bool enable) {
+    if (enable) {
+        EIC->INTFLAG.reg = CDONE_EXTINT_MASK;
+        EIC->INTENSET.reg = CDONE_EXTINT_MASK;
+    } else {
+        EIC->INTENCLR.reg = CDONE_EXTINT_MASK;
+    }
+}
+#else
+// CDONE is only polled, at the moments config_check() runs
+static void cdone_init(void) {}
+static void cdone_arm(bool enable) {}
+#endif
+
+static void config_finish(uint32_t now, bool done) {
+    FPGA_ConfigStats *st = &config_stats;
+    FPGA_ConfigRecord *r = &st->records[0];
+
+    cdone_arm(false);
+    config_pending = false;
+    r->done = done;
+    r->duration_us = (now - config_start) / (CPU_FREQUENCY / 1000000);
+    if (r->source == FPGA_CONFIG_STREAM)
+        r->bytes = stream_bytes;
+
+    st->configs++;
+    if (done) {
+        st->last_us = r->duration_us;
+        if (!st->min_us || r->duration_us < st->min_us)
+            st->min_us = r->duration_us;
+        if (r->duration_us > st->max_us)
+            st->max_us = r->duration_us;
+        st->total_us += r->duration_us;
+    } else {
+        st->failures++;
+    }
+    update_file();
+}
+
+static void config_check(void) {
+    if (!config_pending)
+        return;
+    if (cdone_seen)
+        config_finish(cdone_at, true);
+    else if (fpga_done()) // no EIC, or the edge came before it was armed
+        config_finish(cpu_cycles(), true);
+}
+
+// `start` is the cpu_cycles() at which CRESET was released.
+static void config_begin(uint32_t source, uint32_t start) {
+    FPGA_ConfigStats *st = &config_stats;
+
+    // an earlier one that never finished
+    if (config_pending)
+        config_finish(cpu_cycles(), false);
+
+    memmove(&st->records[1], &st->records[0], sizeof(st->records) - sizeof(st->records[0]));
+    if (st->num_records < FPGA_CONFIG_HISTORY)
+        st->num_records++;
+    memset(&st->records[0], 0, sizeof(st->records[0]));
+    st->records[0].source = source;
+    st->records[0].time_ms = sysTicks / (SYSTICK_HZ / 1000);
+
+    config_start = start;
+    cdone_seen = false;
+    config_pending = true;
+    cdone_arm(true);
+}
+
+// Close the current configuration; failed unless CDONE went high by now.
+static void config_end(void) {
+    config_check();
+    if (config_pending)
+        config_finish(cpu_cycles(), false);
+}
+
+void fpga_update_status(void) {
+    config_check();
+}
+
+void fpga_config_stats(FPGA_ConfigStats *stats) {
+    config_check();
+    *stats = config_stats;
+    stats->pending = config_pending;
+    stats->cdone = fpga_done();
+}
+
+static void send_clocks(uint32_t num_bytes) {
+    struct spi_xfer xfer = {NULL, NULL, num_bytes};
+    spi_m_sync_transfer(&xfer);
+}
+
+// Cache the slot headers and find the slot the boot header points at.
+static void read_slots(void) {
+    uint8_t entry[12];
+
+    ext_flash_flush();
+    for (int i = 0; i < FPGA_NUM_SLOTS; ++i) {
+        slots[i].magic = 0;
+        // past the end, the flash would just wrap around to an earlier slot
+        if (!slot_fits(i))
+            continue;
+        spi_flash_read_data(slot_addr(i), (uint8_t *)&slots[i], sizeof(slots[i]));
+        if (slots[i].length > FPGA_SLOT_SIZE - FPGA_SLOT_HEADER_SIZE)
+            slots[i].magic = 0;
+    }
+
+    active_slot = -1;
+    spi_flash_read_data(FPGA_BOOT_HEADER_ADDR, entry, sizeof(entry));
+    if (memcmp(entry, "\x7e\xaa\x99\x7e", 4) || entry[7] != 0x44)
+        return;
+    uint32_t addr = (entry[9] << 16) | (entry[10] << 8) | entry[11];
+    for (int i = 0; i < FPGA_NUM_SLOTS; ++i)
+        if (addr == bitstream_addr(i) && slot_fits(i))
+            active_slot = i;
+}
+
+uint32_t fpga_bitstream_size(void) {
+    return active_slot < 0 ? 0 : slots[active_slot].length;
+}
+
+void fpga_read_bitstream(uint32_t offset, uint8_t *dst) {
+    uint32_t length = fpga_bitstream_size();
+
+    if (offset >= length)
+        return;
+    ext_flash_read_sector(bitstream_addr(active_slot) + offset, dst);
+    if (length - offset < 512)
+        memset(dst + (length - offset), 0, 512 - (length - offset));
+}
+
+static bool commit_slot(uint32_t slot, uint32_t length, uint32_t version) {
+    __attribute__((__aligned__(4))) uint8_t page[FPGA_SLOT_HEADER_SIZE];
+
+    // 0 stands for whatever was just uploaded, without its padding
+    if (!slot_fits(slot))
+        return false;
+    if (!length)
+        length = bitstream_upload_length(bitstream_addr(slot));
+    if (!length || length > FPGA_SLOT_SIZE - FPGA_SLOT_HEADER_SIZE)
+        return false;
+
+    FPGA_SlotHeader hd = {
+        .magic = FPGA_SLOT_MAGIC,
+        .version = version,
+        .length = length,
+        .crc32 = ext_flash_crc32(bitstream_addr(slot), length),
+    };
+    memset(page, 0xff, sizeof(page));
+    memcpy(page, &hd, sizeof(hd));
+    // a new erase session, as the header isn't blank if the slot was committed
+    // before; the bitstream in the rest of the sector is kept
+    ext_flash_flush();
+    ext_flash_write_page(slot_addr(slot), page, slot_addr(slot) + FPGA_SLOT_HEADER_SIZE);
+    read_slots();
+    return true;
+}
+
+// One entry of the iCE40 multi-boot header, as written by icemulti.
+static void boot_entry(uint8_t *p, uint32_t addr) {
+    static const uint8_t entry[] = {
+        0x7e, 0xaa, 0x99, 0x7e, // preamble
+        0x92, 0x00, 0x00,       // boot mode
+        0x44, 0x03, 0, 0, 0,    // boot address
+        0x82, 0x00, 0x00,       // bank offset
+        0x01, 0x08,             // reboot
+    };
+    memset(p, 0, 32);
+    memcpy(p, entry, sizeof(entry));
+    p[9] = addr >> 16;
+    p[10] = addr >> 8;
+    p[11] = addr;
+}
+
+static bool select_slot(uint32_t slot) {
+    __attribute__((__aligned__(4))) uint8_t page[SPI_FLASH_PAGE_SIZE];
+
+    read_slots();
+    if (!slot_fits(slot) || slots[slot].magic != FPGA_SLOT_MAGIC ||
+        ext_flash_crc32(bitstream_addr(slot), slots[slot].length) != slots[slot].crc32)
+        return false;
+
+    // power-on entry, then the four warm boot images
+    memset(page, 0xff, sizeof(page));
+    boot_entry(page, bitstream_addr(slot));
+    for (int i = 0; i < 4; ++i)
+        boot_entry(page + 32 * (i + 1), bitstream_addr(slot_fits(i) ? i : slot));
+    ext_flash_replace_page(FPGA_BOOT_HEADER_ADDR, page);
+    read_slots();
+
+    return fpga_boot_from_flash();
+}
+
+bool fpga_control(const FPGA_Control *ctrl) {
+    switch (ctrl->command) {
+    case FPGA_CTRL_COMMIT:
+        return commit_slot(ctrl->slot, ctrl->length, ctrl->version);
+    case FPGA_CTRL_SELECT:
+        return select_slot(ctrl->slot);
+    }
+    return false;
+}
+
+bool fpga_done(void) {
+    return PINVAL(BOARD_FPGA_CDONE_PIN) != 0;
+}
+
+void fpga_init(void) {
+    PINOP(BOARD_FPGA_CDONE_PIN, DIRCLR);
+    PORT->Group[BOARD_FPGA_CDONE_PIN / 32].PINCFG[BOARD_FPGA_CDONE_PIN % 32].reg =
+        PORT_PINCFG_INEN | PORT_PINCFG_PULLEN;
+    PINOP(BOARD_FPGA_CDONE_PIN, OUTSET); // pull-up
+
+    // let the FPGA boot from the SPI flash
+    PINOP(BOARD_FPGA_CRESET_PIN, OUTSET);
+    PINOP(BOARD_FPGA_CRESET_PIN, DIRSET);
+    PINOP(BOARD_FPGA_CS_PIN, OUTSET);
+    PINOP(BOARD_FPGA_CS_PIN, DIRSET);
+#ifdef BOARD_FPGA_REG_CS_PIN
+    PINOP(BOARD_FPGA_REG_CS_PIN, OUTSET);
+    PINOP(BOARD_FPGA_REG_CS_PIN, DIRSET);
+#endif
+
+    // the FPGA started loading itself when the power came up, about when we did
+    cdone_init();
+    config_begin(FPGA_CONFIG_POWER_ON, 0);
+    config_check();
+
+    read_slots();
+    set_status(fpga_done() ? "FPGA: configured from flash" : "FPGA: not configured", false);
+}
+
+bool fpga_boot_from_flash(void) {
+#if USE_FPGA_REGS
+    fpga_regs_capture_stop();
+#endif
+    ext_flash_flush();
+
+    // the FPGA is the SPI master while it loads itself
+    spi_m_sync_release();
+    PINOP(BOARD_FPGA_CS_PIN, DIRCLR);
+
+    PINOP(BOARD_FPGA_CRESET_PIN, OUTCLR);
+    delay_us(CRESET_LOW_US);
+    PINOP(BOARD_FPGA_CRESET_PIN, OUTSET);
+    config_begin(FPGA_CONFIG_FLASH, cpu_cycles());
+    for (int i = 0; i < BOOT_TIMEOUT_MS && !fpga_done(); ++i)
+        delay_us(1000);
+    bool done = fpga_done();
+    config_end();
+
+    PINOP(BOARD_FPGA_CS_PIN, OUTSET);
+    PINOP(BOARD_FPGA_CS_PIN, DIRSET);
+    spi_m_sync_acquire();
+
+    set_status(done ? "FPGA: configured from flash" : "FPGA: CDONE low after boot from flash",
+               false);
+    return done;
+}
+
+// Put the FPGA into slave SPI mode: CS low while CRESET goes high.
+static void stream_begin(void) {
+#if USE_FPGA_REGS
+    // CS stays low from block to block; a capture can't run in between
+    fpga_regs_capture_stop();
+#endif
+#ifdef BOARD_FLASH_CS_PIN
+    // the flash shares the bus; nothing may be in flight
+    ext_flash_flush();
+#endif
+    spi_m_dma_wait();
+    PINOP(BOARD_FPGA_CS_PIN, OUTCLR);
+    PINOP(BOARD_FPGA_CRESET_PIN, OUTCLR);
+    delay_us(CRESET_LOW_US);
+    PINOP(BOARD_FPGA_CRESET_PIN, OUTSET);
+    config_begin(FPGA_CONFIG_STREAM, cpu_cycles());
+    delay_us(CRESET_CLEAR_US);
+
+    // 8 clocks with CS high, then the bitstream
+    PINOP(BOARD_FPGA_CS_PIN, OUTSET);
+    send_clocks(1);
+    PINOP(BOARD_FPGA_CS_PIN, OUTCLR);
+
+    stream_state = STREAM_ACTIVE;
+    stream_next_block = 0;
+    stream_bytes = 0;
+    stream_received = 0;
+    set_status("FPGA: configuring", false);
+}
+
+static void stream_end(void) {
+    send_clocks(TRAILING_CLOCKS);
+    PINOP(BOARD_FPGA_CS_PIN, OUTSET);
+    stream_state = STREAM_IDLE;
+    config_end();
+
+    if (fpga_done()) {
+        // extra clocks to activate the user I/O
+        send_clocks(TRAILING_CLOCKS);
+        set_status("FPGA: configured, bytes:", true);
+    } else {
+        set_status("FPGA: CDONE low, bytes:", true);
+    }
+}
+
+static void stream_abort(const char *msg) {
+    PINOP(BOARD_FPGA_CS_PIN, OUTSET);
+    stream_state = STREAM_IDLE;
+    config_end();
+    set_status(msg, true);
+}
+
+bool fpga_stream_begin_block(UF2_Block *bl) {
+    if (bl->blockNo == 0) {
+        stream_begin();
+    } else if (stream_state != STREAM_ACTIVE) {
+        return false; // rest of an aborted stream
+    } else if (bl->blockNo != stream_next_block) {
+        // slave SPI configuration can't seek; the host has to resend the file
+        stream_abort("FPGA: block out of order at byte");
+        return false;
+    }
+    return true;
+}
+
+void fpga_stream_write(uint8_t *data, uint32_t len) {
+    if (!stream_received) {
+        BitstreamInfo info;
+        bitstream_parse(data, len, &info);
+        stream_skip = info.header;
+        stream_left = info.length ? info.length : 0xffffffff;
+    }
+    stream_received += len;
+
+    uint32_t n = stream_skip < len ? stream_skip : len;
+    data += n;
+    len -= n;
+    stream_skip -= n;
+    // padding after the payload, or anything once the FPGA woke up, is not needed
+    if (len > stream_left)
+        len = stream_left;
+    if (!len || fpga_done())
+        return;
+
+    struct spi_xfer xfer = {data, NULL, len};
+    spi_m_sync_transfer(&xfer);
+    stream_bytes += len;
+    stream_left -= len;
+}
+
+void fpga_stream_end_block(UF2_Block *bl) {
+    stream_next_block++;
+    if (stream_next_block >= bl->numBlocks)
+        stream_end();
+}
+
+#endif
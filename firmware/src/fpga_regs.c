@@ -0,0 +1,334 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * Register access to the FPGA user logic over the vendor bulk interface
+ *
+ * A whole FPGA_RegList is collected from USB_EP_FPGA, executed, and answered
+ * with one FPGA_RegReply, so a batch of register accesses costs one USB round
+ * trip. On the SPI bus (shared with the flash, but with its own chip select,
+ * BOARD_FPGA_REG_CS_PIN) the user logic sees
+ *
+ *   write: 0x02, address (big endian, 16 bit), data...
+ *   read:  0x03, address (big endian, 16 bit), one dummy byte, data...
+ *
+ * and is expected to auto-increment the address after each data byte.
+ *
+ * In capture mode one register, normally a FIFO, is read over and over by
+ * DMA into two buffers in turn. While one fills, the other is sent to the
+ * host; the SPI only has to wait when the host falls behind.
+ */
+
+#include "uf2.h"
+
+#if USE_FPGA_REGS
+
+#define SPI_REG_WRITE 0x02
+#define SPI_REG_READ 0x03
+
+static PacketBuffer cache;
+__attribute__((__aligned__(4))) static uint8_t list[sizeof(FPGA_RegList) + FPGA_REG_LIST_SIZE];
+static uint32_t list_len;
+// bytes of a rejected list still to be received
+static uint32_t skip_len;
+
+__attribute__((__aligned__(4))) static uint8_t reply[sizeof(FPGA_RegReply) + FPGA_REG_REPLY_SIZE];
+
+typedef struct {
+    FPGA_CaptureHeader hd;
+    uint8_t data[FPGA_CAPTURE_BUFFER_SIZE];
+} CaptureBuffer;
+
+static CaptureBuffer capture_buf[2];
+// set by the DMA interrupt once the buffer is filled, cleared once it's sent
+static volatile bool capture_full[2];
+static bool capturing;
+static uint8_t capture_next;
+static volatile int8_t capture_filling = -1;
+// the buffer USB_WriteSubmit() is sending
+static int8_t capture_sending = -1;
+// the SPI is waiting for the host; counted as one overrun
+static bool capture_stalled;
+static uint8_t capture_cmd[4];
+static struct spi_xfer capture_header = {capture_cmd, NULL, sizeof(capture_cmd)};
+static struct spi_xfer capture_data;
+static uint16_t capture_sequence;
+static volatile uint32_t capture_overruns;
+static uint32_t capture_bytes, capture_buffers, capture_start, capture_stop;
+
+static void reg_transfer(uint8_t command, uint16_t addr, uint8_t *tx, uint8_t *rx, uint32_t len) {
+    uint8_t header[4] = {command, addr >> 8, addr & 0xff, 0xff};
+    struct spi_xfer xfer = {header, NULL, command == SPI_REG_READ ? 4 : 3};
+    struct spi_xfer data = {tx, rx, len};
+
+    spi_m_dma_wait();
+    PINOP(BOARD_FPGA_REG_CS_PIN, OUTCLR);
+    spi_m_sync_transfer(&xfer);
+    spi_m_sync_transfer(&data);
+    PINOP(BOARD_FPGA_REG_CS_PIN, OUTSET);
+}
+
+static void capture_done(void) {
+    int i = capture_filling;
+
+    PINOP(BOARD_FPGA_REG_CS_PIN, OUTSET);
+    capture_full[i] = true;
+    capture_filling = -1;
+}
+
+static void capture_stats(FPGA_CaptureStats *st) {
+    uint32_t ticks = (capturing ? sysTicks : capture_stop) - capture_start;
+
+    st->bytes = capture_bytes;
+    st->buffers = capture_buffers;
+    st->overruns = capture_overruns;
+    st->bytes_per_second = ticks ? (uint64_t)capture_bytes * SYSTICK_HZ / ticks : 0;
+}
+
+static void capture_begin(uint16_t addr) {
+    capture_cmd[0] = SPI_REG_READ;
+    capture_cmd[1] = addr >> 8;
+    capture_cmd[2] = addr & 0xff;
+    capture_cmd[3] = 0xff;
+    capture_full[0] = capture_full[1] = false;
+    capture_sending = -1;
+    capture_stalled = false;
+    capture_next = 0;
+    capture_sequence = 0;
+    capture_overruns = capture_bytes = capture_buffers = 0;
+    capture_start = sysTicks;
+    capturing = true;
+}
+
+static void capture_end(void) {
+    if (capturing)
+        capture_stop = sysTicks;
+    capturing = false;
+    while (capture_filling >= 0)
+        ;
+}
+
+// Keep the DMA busy with whichever buffer is free and send the full ones. The
+// host may stop reading at any time, so nothing here waits for USB.
+static void capture_process(void) {
+    if (!capturing)
+        return;
+
+    if (capture_sending >= 0 && USB_WriteDone(USB_EP_FPGA)) {
+        capture_full[capture_sending] = false;
+        capture_sending = -1;
+    }
+
+    if (capture_filling < 0 && capture_full[capture_next] && !capture_stalled) {
+        capture_stalled = true;
+        capture_overruns++;
+    }
+
+    // the flash may have the bus for an asynchronous page write
+    if (capture_filling < 0 && !capture_full[capture_next] && !spi_m_dma_busy()) {
+        capture_stalled = false;
+        CaptureBuffer *buf = &capture_buf[capture_next];
+        capture_data.txbuf = NULL;
+        capture_data.rxbuf = buf->data;
+        capture_data.size = sizeof(buf->data);
+        capture_filling = capture_next;
+        capture_next = !capture_next;
+        PINOP(BOARD_FPGA_REG_CS_PIN, OUTCLR);
+        spi_m_dma_transfer(&capture_header, &capture_data, capture_done);
+    }
+
+    if (capture_sending >= 0)
+        return;
+
+    // the oldest full buffer is the one filled before the current one
+    for (int k = 0; k < 2; ++k) {
+        int i = (capture_next + k) % 2;
+        if (!capture_full[i])
+            continue;
+        CaptureBuffer *buf = &capture_buf[i];
+        buf->hd.sequence = capture_sequence++;
+        buf->hd.status = FPGA_REG_CAPTURE_DATA;
+        buf->hd.overruns = capture_overruns > 0xffff ? 0xffff : capture_overruns;
+        buf->hd.size = sizeof(buf->data);
+        USB_WriteSubmit(buf, sizeof(*buf), USB_EP_FPGA);
+        capture_bytes += sizeof(buf->data);
+        capture_buffers++;
+        capture_sending = i;
+        break;
+    }
+}
+
+// Run the ops of the list; fills in status and failed_op of the reply.
+static void run_list(FPGA_RegReply *hd, uint8_t *ops, uint32_t size) {
+    uint8_t *out = reply + sizeof(FPGA_RegReply);
+    uint8_t *out_end = out + FPGA_REG_REPLY_SIZE;
+    uint8_t *end = ops + size;
+    FPGA_RegOp op;
+    FPGA_RegPoll poll;
+
+    hd->status = FPGA_REG_OK;
+    hd->failed_op = 0;
+
+    // a flash page may still be going out by DMA
+    spi_flash_async_wait();
+
+    for (uint8_t *p = ops; p < end; hd->failed_op++) {
+        if (p + sizeof(op) > end)
+            goto bad_op;
+        memcpy(&op, p, sizeof(op));
+        p += sizeof(op);
+
+        switch (op.op) {
+        case FPGA_REG_WRITE:
+            if (p + op.length > end)
+                goto bad_op;
+            reg_transfer(SPI_REG_WRITE, op.addr, p, NULL, op.length);
+            p += op.length;
+            break;
+        case FPGA_REG_READ:
+            if (out + op.length > out_end)
+                goto too_large;
+            reg_transfer(SPI_REG_READ, op.addr, NULL, out, op.length);
+            out += op.length;
+            break;
+        case FPGA_REG_POLL:
+            if (p + sizeof(poll) > end || op.length < 1 || op.length > 4)
+                goto bad_op;
+            if (out + op.length > out_end)
+                goto too_large;
+            memcpy(&poll, p, sizeof(poll));
+            p += sizeof(poll);
+            if (!poll.tries)
+                goto bad_op;
+            uint32_t value = 0;
+            uint32_t poll_start = sysTicks;
+            do {
+                reg_transfer(SPI_REG_READ, op.addr, NULL, out, op.length);
+                memcpy(&value, out, op.length);
+            } while ((value & poll.mask) != poll.expected && --poll.tries &&
+                     sysTicks - poll_start < FPGA_REG_POLL_MAX_MS * (SYSTICK_HZ / 1000));
+            out += op.length;
+            if ((value & poll.mask) != poll.expected) {
+                hd->status = FPGA_REG_ERR_TIMEOUT;
+                goto done;
+            }
+            break;
+#ifdef BOARD_JTAG_TCK_PIN
+        case FPGA_REG_XSVF:
+            if (p + op.length > end)
+                goto bad_op;
+            if (op.addr & 1)
+                xsvf_begin();
+            xsvf_write(p, op.length);
+            p += op.length;
+            if (xsvf_result() > XSVF_DONE) {
+                hd->status = FPGA_REG_ERR_JTAG;
+                goto done;
+            }
+            break;
+#endif
+        case FPGA_REG_CAPTURE_START:
+            capture_begin(op.addr);
+            break;
+        case FPGA_REG_CAPTURE_STOP:
+        case FPGA_REG_CAPTURE_STATS:
+            if (out + sizeof(FPGA_CaptureStats) > out_end)
+                goto too_large;
+            if (op.op == FPGA_REG_CAPTURE_STOP)
+                capture_end();
+            FPGA_CaptureStats st;
+            capture_stats(&st);
+            memcpy(out, &st, sizeof(st));
+            out += sizeof(st);
+            break;
+        default:
+            goto bad_op;
+        }
+    }
+    goto done;
+
+bad_op:
+    hd->status = FPGA_REG_ERR_OP;
+    goto done;
+too_large:
+    hd->status = FPGA_REG_ERR_SIZE;
+done:
+    hd->size = out - (reply + sizeof(FPGA_RegReply));
+}
+
+void fpga_regs_capture_stop(void) {
+    capture_end();
+}
+
+void fpga_regs_reset(void) {
+    // nobody is reading the capture anymore
+    capture_end();
+    capture_sending = -1;
+    memset(&cache, 0, sizeof(cache));
+    list_len = skip_len = 0;
+}
+
+void process_fpga_regs(void) {
+    FPGA_RegList *req = (void *)list;
+    FPGA_RegReply *hd = (void *)reply;
+
+    capture_process();
+
+    if (skip_len) {
+        uint32_t n = USB_ReadCore(NULL, skip_len, USB_EP_FPGA, &cache);
+        // a NULL destination only peeks; drop what was received
+        if (n) {
+            n = n < skip_len ? n : skip_len;
+            cache.ptr += n;
+            skip_len -= n;
+        }
+        return;
+    }
+
+    list_len += USB_ReadCore(list + list_len, sizeof(list) - list_len, USB_EP_FPGA, &cache);
+    if (list_len < sizeof(FPGA_RegList))
+        return;
+
+    uint32_t used = sizeof(FPGA_RegList) + req->size;
+    hd->tag = req->tag;
+    if (req->size > FPGA_REG_LIST_SIZE) {
+        skip_len = used - list_len;
+        used = list_len;
+        hd->status = FPGA_REG_ERR_SIZE;
+        hd->failed_op = 0;
+        hd->size = 0;
+    } else if (list_len < used) {
+        return;
+    } else {
+        run_list(hd, list + sizeof(FPGA_RegList), req->size);
+    }
+
+    // the host may have sent the next list right behind this one
+    list_len -= used;
+    memmove(list, list + used, list_len);
+    USB_Write(reply, sizeof(FPGA_RegReply) + hd->size, USB_EP_FPGA);
+}
+
+#endif
@@ -2,15 +2,28 @@
 
 #if USE_HID || USE_WEBUSB
 
+#if USE_WEBUSB
+// bulk transfers make bigger messages worthwhile; four flash rows per write
+#define HF2_MESSAGE_SIZE (4 * FLASH_ROW_SIZE + 64)
+#else
+#define HF2_MESSAGE_SIZE (FLASH_ROW_SIZE + 64)
+#endif
+
+#if USE_USB_STATS
+// HF2_CMD_USB_STATS answers with these in one message
+STATIC_ASSERT(4 + sizeof(USB_Stats) <= HF2_MESSAGE_SIZE);
+STATIC_ASSERT(4 + sizeof(SCSI_Stats) <= HF2_MESSAGE_SIZE);
+#endif
+
 typedef struct {
     PacketBuffer pbuf;
     uint16_t size;
     uint8_t serial;
     uint8_t ep;
     union {
-        uint8_t buf[FLASH_ROW_SIZE + 64];
-        uint32_t buf32[(FLASH_ROW_SIZE + 64) / 4];
-        uint16_t buf16[(FLASH_ROW_SIZE + 64) / 2];
+        uint8_t buf[HF2_MESSAGE_SIZE];
+        uint32_t buf32[HF2_MESSAGE_SIZE / 4];
+        uint16_t buf16[HF2_MESSAGE_SIZE / 2];
         HF2_Command cmd;
         HF2_Response resp;
     };
@@ -49,6 +62,40 @@ int recv_hf2(HID_InBuffer *pkt) {
     return 0;
 }
 
+#if USE_WEBUSB
+// On the bulk endpoint a whole message is framed in here and goes out as one
+// transfer, while the next command is being received.
+__attribute__((__aligned__(4))) static uint8_t bulkOut[(HF2_MESSAGE_SIZE + 62) / 63 * 64];
+
+static void send_hf2_bulk(const uint8_t *ptr, int size, int flag) {
+    for (;;) {
+        // the previous message may still be on its way out
+        USB_WriteWait(USB_EP_WEB);
+
+        uint8_t *out = bulkOut;
+        bool last = false;
+        // all but the last packet are full, so the host sees the same packets as over HID
+        while (!last && out + 64 <= bulkOut + sizeof(bulkOut)) {
+            int s = 63;
+            if (size <= 63) {
+                s = size;
+                if (flag == HF2_FLAG_CMDPKT_BODY)
+                    flag = HF2_FLAG_CMDPKT_LAST;
+                last = true;
+            }
+            *out++ = flag | s;
+            memcpy(out, ptr, s);
+            out += s;
+            ptr += s;
+            size -= s;
+        }
+        USB_WriteSubmit(bulkOut, out - bulkOut, USB_EP_WEB);
+        if (last)
+            break;
+    }
+}
+#endif
+
 // Send HF2 message.
 // Use command message when flag == HF2_FLAG_CMDPKT_BODY
 // Use serial stdout for HF2_FLAG_SERIAL_OUT and stderr for HF2_FLAG_SERIAL_ERR.
@@ -56,6 +103,13 @@ void send_hf2(const void *data, int size, int ep, int flag) {
     uint8_t buf[64];
     const uint8_t *ptr = data;
 
+#if USE_WEBUSB
+    if (ep == USB_EP_WEB) {
+        send_hf2_bulk(ptr, size, flag);
+        return;
+    }
+#endif
+
     for (;;) {
         int s = 63;
         if (size <= 63) {
@@ -90,6 +144,42 @@ static void checksum_pages(HID_InBuffer *pkt, int start, int num) {
     send_hf2_response(pkt, num * 2);
 }
 
+// whole rows, all of them in the application area
+static bool check_flash_pages_write(struct HF2_WRITE_FLASH_PAGES_Command *cmd, uint32_t len) {
+    return len % FLASH_ROW_SIZE == 0 && cmd->target_addr % FLASH_ROW_SIZE == 0 &&
+           cmd->target_addr >= APP_START_ADDRESS && cmd->target_addr <= FLASH_SIZE &&
+           len <= FLASH_SIZE - cmd->target_addr;
+}
+
+static void write_flash_pages(struct HF2_WRITE_FLASH_PAGES_Command *cmd, uint32_t len) {
+    for (uint32_t i = 0; i < len; i += FLASH_ROW_SIZE)
+        flash_write_row((void *)(cmd->target_addr + i), cmd->data + i / 4);
+}
+
+#ifdef BOARD_FLASH_CS_PIN
+// where the last HF2_CMD_WRITE_SPI_FLASH ended; a write anywhere else starts a
+// new erase session
+static uint32_t spiFlashNext;
+
+static bool check_spi_flash_write(struct HF2_WRITE_SPI_FLASH_Command *cmd, uint32_t len) {
+    // the erase session only covers what the bitmap can track
+    uint32_t size = spi_flash_size();
+    if (size > SPI_FLASH_MAX_SIZE)
+        size = SPI_FLASH_MAX_SIZE;
+    return len % SPI_FLASH_PAGE_SIZE == 0 && cmd->target_addr % SPI_FLASH_PAGE_SIZE == 0 &&
+           cmd->end_addr <= size && cmd->target_addr <= cmd->end_addr &&
+           len <= cmd->end_addr - cmd->target_addr;
+}
+
+static void write_spi_flash(struct HF2_WRITE_SPI_FLASH_Command *cmd, uint32_t len) {
+    if (cmd->target_addr != spiFlashNext)
+        ext_flash_flush();
+    for (uint32_t i = 0; i < len; i += SPI_FLASH_PAGE_SIZE)
+        ext_flash_write_page(cmd->target_addr + i, (uint8_t *)cmd->data + i, cmd->end_addr);
+    spiFlashNext = cmd->target_addr + len;
+}
+#endif
+
 void process_core(HID_InBuffer *pkt) {
     int sz = recv_hf2(pkt);
 
@@ -159,6 +249,17 @@ void process_core(HID_InBuffer *pkt) {
             flash_write_row((void *)cmd->write_flash_page.target_addr, cmd->write_flash_page.data);
         }
         return;
+    case HF2_CMD_WRITE_FLASH_PAGES:
+        tmp = sz - 8 - sizeof(cmd->write_flash_pages);
+        // checked before the ACK, which the host takes as success
+        if (sz < 8 + (int)sizeof(cmd->write_flash_pages) ||
+            !check_flash_pages_write(&cmd->write_flash_pages, tmp)) {
+            resp->status16 = HF2_STATUS_EXEC_ERR;
+            break;
+        }
+        send_hf2_response(pkt, 0);
+        write_flash_pages(&cmd->write_flash_pages, tmp);
+        return;
 #if USE_HID_EXT
     case HF2_CMD_WRITE_WORDS:
         checkDataSize(write_words, cmd->write_words.num_words << 2);
@@ -176,6 +277,54 @@ void process_core(HID_InBuffer *pkt) {
         checkDataSize(chksum_pages, 0);
         checksum_pages(pkt, cmd->chksum_pages.target_addr, cmd->chksum_pages.num_pages);
         return;
+#ifdef BOARD_FLASH_CS_PIN
+    case HF2_CMD_CRC32_SPI_FLASH:
+        checkDataSize(crc32_spi_flash, 0);
+        resp->data32[0] =
+            ext_flash_crc32(cmd->crc32_spi_flash.target_addr, cmd->crc32_spi_flash.num_bytes);
+        send_hf2_response(pkt, 4);
+        return;
+    case HF2_CMD_WRITE_SPI_FLASH:
+        tmp = sz - 8 - sizeof(cmd->write_spi_flash);
+        if (sz < 8 + (int)sizeof(cmd->write_spi_flash) ||
+            !check_spi_flash_write(&cmd->write_spi_flash, tmp)) {
+            resp->status16 = HF2_STATUS_EXEC_ERR;
+            break;
+        }
+        send_hf2_response(pkt, 0);
+        write_spi_flash(&cmd->write_spi_flash, tmp);
+        return;
+#endif
+#ifdef BOARD_FPGA_CRESET_PIN
+    case HF2_CMD_FPGA_CONTROL:
+        checkDataSize(fpga_control, 0);
+        if (!fpga_control((FPGA_Control *)&cmd->fpga_control))
+            resp->status16 = HF2_STATUS_EXEC_ERR;
+        break;
+    case HF2_CMD_FPGA_STATUS:
+        fpga_config_stats((FPGA_ConfigStats *)resp->data32);
+        send_hf2_response(pkt, sizeof(FPGA_ConfigStats));
+        return;
+#endif
+
+    case HF2_CMD_USB_STATS:
+        checkDataSize(usb_stats, 0);
+        // read before the response overwrites it
+        tmp = cmd->usb_stats.which;
+#if USE_USB_STATS
+        if (tmp == HF2_USB_STATS_BUS) {
+            usb_stats_get((USB_Stats *)resp->data32);
+            send_hf2_response(pkt, sizeof(USB_Stats));
+            return;
+        }
+        if (tmp == HF2_USB_STATS_SCSI) {
+            scsi_stats_get((SCSI_Stats *)resp->data32);
+            send_hf2_response(pkt, sizeof(SCSI_Stats));
+            return;
+        }
+#endif
+        resp->status16 = HF2_STATUS_EXEC_ERR;
+        break;
 
     default:
         // command not understood
@@ -205,6 +354,15 @@ void process_hid() {
 #endif
 }
 
+void hid_reset() {
+#if USE_HID
+    memset(&hidbufData, 0, sizeof(hidbufData));
+#endif
+#if USE_WEBUSB
+    memset(&webbufData, 0, sizeof(webbufData));
+#endif
+}
+
 #if USE_HID_HANDOVER
 void hidHandoverLoop(int ep) {
     handoverPrep();
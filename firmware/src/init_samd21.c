@@ -127,4 +127,23 @@ void system_init(void) {
     // PORT->Group[0].PMUX[30 / 2].reg |= PORT_PMUX_PMUXE_H;
 }
 
-void SysTick_Handler(void) { LED_TICK(); }
+volatile uint32_t sysTicks;
+
+void SysTick_Handler(void) {
+    sysTicks++;
+    timerTick();
+    LED_TICK();
+}
+
+uint32_t cpu_cycles(void) {
+    uint32_t ticks, val, wrapped;
+    do {
+        ticks = sysTicks;
+        val = SysTick->VAL;
+        // the counter reloaded, but the interrupt can't run yet (we're in a handler)
+        wrapped = (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) ? 1 : 0;
+        if (wrapped)
+            val = SysTick->VAL;
+    } while (ticks != sysTicks);
+    return (ticks + wrapped) * (SysTick->LOAD + 1) + SysTick->LOAD - val;
+}
@@ -0,0 +1,261 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * JTAG TAP driver
+ *
+ * Bits are clocked through the single-cycle IOBUS port; TDI/TDO are handled
+ * a 32-bit word at a time. The shortest TMS sequence between any two TAP
+ * states is worked out once by jtag_init().
+ *
+ * Boards that put TDI/TCK/TDO on SERCOM pads (BOARD_JTAG_SERCOM, see
+ * boards/fpga_helper/board_config.h) shift the whole bytes of long scans
+ * with the SERCOM in SPI mode, LSB first; TMS stays low for those.
+ */
+
+#include "uf2.h"
+
+#ifdef BOARD_JTAG_TCK_PIN
+
+#ifndef BOARD_JTAG_BAUDRATE
+#define BOARD_JTAG_BAUDRATE 4000000
+#endif
+
+// scans shorter than this are bit-banged anyway
+#define SPI_MIN_BYTES 4
+
+#define IOPIN(pin) (PORT_IOBUS->Group[(pin) / 32])
+#define PINMASK(pin) (1UL << ((pin) % 32))
+
+static const uint8_t next_state[16][2] = {
+    [JTAG_RESET] = {JTAG_IDLE, JTAG_RESET},
+    [JTAG_IDLE] = {JTAG_IDLE, JTAG_SELECT_DR},
+    [JTAG_SELECT_DR] = {JTAG_CAPTURE_DR, JTAG_SELECT_IR},
+    [JTAG_CAPTURE_DR] = {JTAG_SHIFT_DR, JTAG_EXIT1_DR},
+    [JTAG_SHIFT_DR] = {JTAG_SHIFT_DR, JTAG_EXIT1_DR},
+    [JTAG_EXIT1_DR] = {JTAG_PAUSE_DR, JTAG_UPDATE_DR},
+    [JTAG_PAUSE_DR] = {JTAG_PAUSE_DR, JTAG_EXIT2_DR},
+    [JTAG_EXIT2_DR] = {JTAG_SHIFT_DR, JTAG_UPDATE_DR},
+    [JTAG_UPDATE_DR] = {JTAG_IDLE, JTAG_SELECT_DR},
+    [JTAG_SELECT_IR] = {JTAG_CAPTURE_IR, JTAG_RESET},
+    [JTAG_CAPTURE_IR] = {JTAG_SHIFT_IR, JTAG_EXIT1_IR},
+    [JTAG_SHIFT_IR] = {JTAG_SHIFT_IR, JTAG_EXIT1_IR},
+    [JTAG_EXIT1_IR] = {JTAG_PAUSE_IR, JTAG_UPDATE_IR},
+    [JTAG_PAUSE_IR] = {JTAG_PAUSE_IR, JTAG_EXIT2_IR},
+    [JTAG_EXIT2_IR] = {JTAG_SHIFT_IR, JTAG_UPDATE_IR},
+    [JTAG_UPDATE_IR] = {JTAG_IDLE, JTAG_SELECT_DR},
+};
+
+// TMS bits (first one in bit 0) taking the TAP from one state to another
+typedef struct {
+    uint8_t tms;
+    uint8_t len;
+} TmsPath;
+
+static TmsPath tms_path[16][16];
+static uint8_t tap_state;
+
+static inline uint32_t clock_bit(uint32_t tms, uint32_t tdi) {
+    if (tms)
+        IOPIN(BOARD_JTAG_TMS_PIN).OUTSET.reg = PINMASK(BOARD_JTAG_TMS_PIN);
+    else
+        IOPIN(BOARD_JTAG_TMS_PIN).OUTCLR.reg = PINMASK(BOARD_JTAG_TMS_PIN);
+    if (tdi)
+        IOPIN(BOARD_JTAG_TDI_PIN).OUTSET.reg = PINMASK(BOARD_JTAG_TDI_PIN);
+    else
+        IOPIN(BOARD_JTAG_TDI_PIN).OUTCLR.reg = PINMASK(BOARD_JTAG_TDI_PIN);
+    // TDO changed on the last falling edge; the TAP samples TDI/TMS on the rising one
+    uint32_t tdo = IOPIN(BOARD_JTAG_TDO_PIN).IN.reg & PINMASK(BOARD_JTAG_TDO_PIN);
+    IOPIN(BOARD_JTAG_TCK_PIN).OUTSET.reg = PINMASK(BOARD_JTAG_TCK_PIN);
+    IOPIN(BOARD_JTAG_TCK_PIN).OUTCLR.reg = PINMASK(BOARD_JTAG_TCK_PIN);
+    return tdo != 0;
+}
+
+static void clock_tms(uint8_t tms, uint8_t len) {
+    for (uint8_t i = 0; i < len; ++i, tms >>= 1)
+        clock_bit(tms & 1, 0);
+}
+
+// Breadth-first search from every state; paths are at most 7 clocks long.
+static void build_tms_paths(void) {
+    for (int from = 0; from < 16; ++from) {
+        uint8_t queue[16], head = 0, tail = 0;
+        bool seen[16] = {0};
+
+        seen[from] = true;
+        queue[tail++] = from;
+        tms_path[from][from].len = 0;
+        while (head < tail) {
+            uint8_t s = queue[head++];
+            for (int tms = 0; tms < 2; ++tms) {
+                uint8_t t = next_state[s][tms];
+                if (seen[t])
+                    continue;
+                seen[t] = true;
+                tms_path[from][t].tms = tms_path[from][s].tms | (tms << tms_path[from][s].len);
+                tms_path[from][t].len = tms_path[from][s].len + 1;
+                queue[tail++] = t;
+            }
+        }
+    }
+}
+
+#ifdef BOARD_JTAG_SERCOM
+#include "uart_driver.h"
+
+static void set_pmux(uint32_t pinmux, bool enable) {
+    uint8_t pin = pinmux >> 16;
+    PORT->Group[pin / 32].PMUX[(pin % 32) / 2].reg &= ~(0xF << (4 * (pin & 0x01u)));
+    PORT->Group[pin / 32].PMUX[(pin % 32) / 2].reg |= (pinmux & 0xFF) << (4 * (pin & 0x01u));
+    PORT->Group[pin / 32].PINCFG[pin % 32].bit.PMUXEN = enable;
+}
+
+static void spi_init(void) {
+    Sercom *sercom = BOARD_JTAG_SERCOM;
+    uint32_t inst = uart_get_sercom_index(sercom);
+
+    PM->APBCMASK.reg |= (1u << (inst + PM_APBCMASK_SERCOM0_Pos));
+    GCLK->CLKCTRL.reg =
+        GCLK_CLKCTRL_ID(inst + GCLK_ID_SERCOM0_CORE) | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+
+    sercom->SPI.CTRLA.bit.SWRST = 1;
+    while (sercom->SPI.CTRLA.bit.SWRST || sercom->SPI.SYNCBUSY.bit.SWRST)
+        ;
+
+    /* SPI master, mode 0, LSB first, like a JTAG scan */
+    sercom->SPI.CTRLA.reg = SERCOM_SPI_CTRLA_MODE_SPI_MASTER | SERCOM_SPI_CTRLA_DORD |
+                            SERCOM_SPI_CTRLA_DOPO(BOARD_JTAG_DOPO) |
+                            SERCOM_SPI_CTRLA_DIPO(BOARD_JTAG_DIPO);
+    sercom->SPI.CTRLB.reg = SERCOM_SPI_CTRLB_RXEN | SERCOM_SPI_CTRLB_CHSIZE(0);
+    while (sercom->SPI.SYNCBUSY.bit.CTRLB)
+        ;
+    sercom->SPI.BAUD.reg = CPU_FREQUENCY / (2 * BOARD_JTAG_BAUDRATE) - 1;
+    sercom->SPI.CTRLA.bit.ENABLE = 1;
+    while (sercom->SPI.SYNCBUSY.bit.ENABLE)
+        ;
+}
+
+// Shift whole bytes with TMS low; TCK is low before and after.
+static void spi_shift(const uint8_t *tdi, uint8_t *tdo, uint32_t nbytes) {
+    Sercom *sercom = BOARD_JTAG_SERCOM;
+
+    IOPIN(BOARD_JTAG_TMS_PIN).OUTCLR.reg = PINMASK(BOARD_JTAG_TMS_PIN);
+    set_pmux(BOARD_JTAG_TDI_PINMUX, true);
+    set_pmux(BOARD_JTAG_TCK_PINMUX, true);
+    set_pmux(BOARD_JTAG_TDO_PINMUX, true);
+    for (uint32_t i = 0; i < nbytes; ++i) {
+        while (!(sercom->SPI.INTFLAG.reg & SERCOM_SPI_INTFLAG_DRE))
+            ;
+        sercom->SPI.DATA.reg = tdi ? tdi[i] : 0;
+        while (!(sercom->SPI.INTFLAG.reg & SERCOM_SPI_INTFLAG_RXC))
+            ;
+        uint8_t b = sercom->SPI.DATA.reg;
+        if (tdo)
+            tdo[i] = b;
+    }
+    set_pmux(BOARD_JTAG_TDI_PINMUX, false);
+    set_pmux(BOARD_JTAG_TCK_PINMUX, false);
+    set_pmux(BOARD_JTAG_TDO_PINMUX, false);
+}
+#endif
+
+void jtag_init(void) {
+    build_tms_paths();
+#ifdef BOARD_JTAG_SERCOM
+    spi_init();
+#endif
+    jtag_end();
+}
+
+void jtag_begin(void) {
+    PINOP(BOARD_JTAG_TCK_PIN, OUTCLR);
+    PINOP(BOARD_JTAG_TCK_PIN, DIRSET);
+    PINOP(BOARD_JTAG_TMS_PIN, OUTSET);
+    PINOP(BOARD_JTAG_TMS_PIN, DIRSET);
+    PINOP(BOARD_JTAG_TDI_PIN, DIRSET);
+    PINOP(BOARD_JTAG_TDO_PIN, DIRCLR);
+    PORT->Group[BOARD_JTAG_TDO_PIN / 32].PINCFG[BOARD_JTAG_TDO_PIN % 32].reg = PORT_PINCFG_INEN;
+    jtag_reset();
+}
+
+void jtag_end(void) {
+    // leave the JTAG header to other tools
+    PINOP(BOARD_JTAG_TCK_PIN, DIRCLR);
+    PINOP(BOARD_JTAG_TMS_PIN, DIRCLR);
+    PINOP(BOARD_JTAG_TDI_PIN, DIRCLR);
+}
+
+void jtag_reset(void) {
+    clock_tms(0x1f, 5);
+    tap_state = JTAG_RESET;
+}
+
+void jtag_goto(uint8_t state) {
+    TmsPath *p = &tms_path[tap_state][state];
+    clock_tms(p->tms, p->len);
+    tap_state = state;
+}
+
+void jtag_idle(uint32_t clocks) {
+    while (clocks--)
+        clock_bit(0, 0);
+}
+
+void jtag_shift(const uint8_t *tdi, uint8_t *tdo, uint32_t nbits, bool exit) {
+    uint32_t done = 0;
+
+    if (!nbits)
+        return;
+
+#ifdef BOARD_JTAG_SERCOM
+    // the last bit may need TMS high, so it's never part of the SPI transfer
+    uint32_t nbytes = (nbits - 1) / 8;
+    if (nbytes >= SPI_MIN_BYTES) {
+        spi_shift(tdi, tdo, nbytes);
+        done = nbytes * 8;
+    }
+#endif
+
+    while (done < nbits) {
+        uint32_t n = nbits - done < 32 ? nbits - done : 32;
+        uint32_t nb = (n + 7) / 8;
+        uint32_t w = 0, r = 0;
+
+        if (tdi)
+            memcpy(&w, tdi + done / 8, nb);
+        for (uint32_t i = 0; i < n; ++i, w >>= 1)
+            r |= clock_bit(exit && done + i == nbits - 1, w & 1) << i;
+        if (tdo)
+            memcpy(tdo + done / 8, &r, nb);
+        done += n;
+    }
+
+    if (exit)
+        tap_state = next_state[tap_state][1];
+}
+
+#endif
@@ -171,7 +171,6 @@ int main(void) {
     delay(15);
 #endif
     led_init();
-    spi_flash_init();
 
     logmsg("Start");
 //    assert((uint32_t)&_etext < APP_START_ADDRESS);
@@ -190,6 +189,11 @@ int main(void) {
     /* System initialization */
     system_init();
 
+#ifdef BOARD_FLASH_CS_PIN
+    // the flash SERCOM runs off GCLK0, so this has to wait for the 48MHz clock
+    spi_flash_init();
+#endif
+
     __DMB();
     __enable_irq();
 
@@ -203,17 +207,17 @@ int main(void) {
 //    delay(1000);
 
 
-    // The response will be 0xff if the flash needs more time to start up.
-    uint8_t jedec_id_response[3] = {0xff, 0xff, 0xff};
-//    int color_shift = 0;
-    spi_flash_read_command(CMD_READ_JEDEC_ID, jedec_id_response, 3);
-//     while (jedec_id_response[0] == 0xff) {
-//         delay(100);
-//         spi_flash_read_command(CMD_READ_JEDEC_ID, jedec_id_response, 3);
-// //        RGBLED_set_color(0x000020);
-//     }
-
-//    uint32_t flash_color = (jedec_id_response[0] << 0) + (jedec_id_response[1] << 8) + (jedec_id_response[2] << 16);
+#ifdef BOARD_FLASH_CS_PIN
+    // run the flash at its rated clock and fastest read mode
+    spi_flash_init_device(spi_flash_detect());
+#endif
+#ifdef BOARD_FPGA_CRESET_PIN
+    // reads the slot headers, so the flash has to be set up
+    fpga_init();
+#endif
+#ifdef BOARD_JTAG_TCK_PIN
+    jtag_init();
+#endif
 
     RGBLED_set_color(0x102010);
 
@@ -240,6 +244,9 @@ int main(void) {
             }
 
             main_b_cdc_enable = true;
+        } else {
+            // enumeration runs in USB_Handler(); SysTick wakes us up at the latest
+            __WFI();
         }
 
 #if USE_MONITOR
@@ -311,13 +311,55 @@ bool try_read_cbw(struct usb_msc_cbw *cbw, uint8_t ep, PacketBuffer *handoverCac
     return true;
 }
 
+// Events from USB_Handler(). The class handlers still look at their endpoints
+// on every pass, as an OUT endpoint is only armed again by the next read; the
+// events wake us up and tell about the bus.
+static void process_usb_events(void) {
+    USB_Event ev;
+    while (usb_get_event(&ev)) {
+        switch (ev.type) {
+        case USB_EVENT_CONFIGURED:
+            // reads armed before the host reset the bus are gone
+#if USE_HID || USE_WEBUSB
+            hid_reset();
+#endif
+#if USE_FPGA_REGS
+            fpga_regs_reset();
+#endif
+            break;
+        case USB_EVENT_OVERFLOW:
+            logmsg("USB events lost");
+            break;
+        }
+    }
+}
+
 void process_msc(void) {
+    process_usb_events();
+
 #if USE_HID || USE_WEBUSB
     process_hid();
 #endif
+#if USE_FPGA_REGS
+    process_fpga_regs();
+#endif
 
-    if (!try_read_cbw(&udi_msc_cbw, USB_EP_MSC_OUT, false))
-        return; // no data
+#ifdef BOARD_FLASH_CS_PIN
+    // keep the external flash busy while waiting for the next command
+    ext_flash_process();
+#endif
+
+    if (!try_read_cbw(&udi_msc_cbw, USB_EP_MSC_OUT, false)) {
+        // no data; sleep until the next USB event or SysTick, checking
+        // for events with interrupts off so none slips in before the WFI
+        __disable_irq();
+        if (!usb_event_pending())
+            __WFI();
+        __enable_irq();
+        return;
+    }
+
+    uint32_t start = usb_stats_now();
 
     // Prepare CSW residue field with the size requested
     udi_msc_csw.dCSWDataResidue = le32_to_cpu(udi_msc_cbw.dCBWDataTransferLength);
@@ -383,6 +425,8 @@ void process_msc(void) {
         udi_msc_csw_process();
         break;
     }
+
+    scsi_stats_record(udi_msc_cbw.CDB[0], start);
 }
 
 static bool udi_msc_cbw_validate(uint32_t alloc_len, uint8_t dir_flag) {
@@ -506,6 +550,27 @@ static void udi_msc_sense_command_invalid(void) {
     udi_msc_sense_fail(SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_INVALID_COMMAND_OPERATION_CODE, 0);
 }
 
+#if USE_FLASH_LUN
+#define FLASH_LUN 1
+
+static bool is_flash_lun(void) {
+    return (udi_msc_cbw.bCBWLUN & USB_CBW_LUN_MASK) == FLASH_LUN;
+}
+#endif
+
+// Capacity of the addressed LUN; 0 if the SPI flash wasn't detected
+static uint32_t lun_num_blocks(void) {
+#if USE_FLASH_LUN
+    if (is_flash_lun()) {
+        uint32_t size = spi_flash_size();
+        if (size > SPI_FLASH_MAX_SIZE)
+            size = SPI_FLASH_MAX_SIZE;
+        return size / UDI_MSC_BLOCK_SIZE;
+    }
+#endif
+    return NUM_FAT_BLOCKS;
+}
+
 //---------------------------------------------
 //------- Routines manage SCSI Commands
 
@@ -523,14 +588,15 @@ static void udi_msc_spc_requestsense(void) {
 }
 
 static void udi_msc_read_format_capacity(void) {
+    uint32_t num_blocks = lun_num_blocks();
     uint8_t buf[12] = {0,
                        0,
                        0,
                        8, // length
-                       (NUM_FAT_BLOCKS >> 24) & 0xFF,
-                       (NUM_FAT_BLOCKS >> 16) & 0xFF,
-                       (NUM_FAT_BLOCKS >> 8) & 0xFF,
-                       (NUM_FAT_BLOCKS >> 0) & 0xFF,
+                       (num_blocks >> 24) & 0xFF,
+                       (num_blocks >> 16) & 0xFF,
+                       (num_blocks >> 8) & 0xFF,
+                       (num_blocks >> 0) & 0xFF,
                        2, // Descriptor Code: Formatted Media
                        0,
                        (512 >> 8) & 0xff,
@@ -596,7 +662,10 @@ if ((0 != (udi_msc_cbw.CDB[1] & (SCSI_INQ_REQ_EVPD | SCSI_INQ_REQ_CMDT))) ||
 static bool udi_msc_spc_testunitready_global(void) { return true; }
 
 static void udi_msc_spc_testunitready(void) {
-    if (udi_msc_spc_testunitready_global()) {
+    if (!lun_num_blocks()) {
+        // no SPI flash behind the raw LUN
+        udi_msc_sense_fail(SCSI_SK_NOT_READY, SCSI_ASC_MEDIUM_NOT_PRESENT, 0);
+    } else if (udi_msc_spc_testunitready_global()) {
         // LUN ready, then update sense data with status pass
         udi_msc_sense_pass();
     }
@@ -698,7 +767,7 @@ static void udi_msc_sbc_read_capacity(void) {
     if (!udi_msc_cbw_validate(sizeof(udi_msc_capacity), USB_CBW_DIRECTION_IN))
         return;
 
-    udi_msc_capacity.max_lba = NUM_FAT_BLOCKS - 1;
+    udi_msc_capacity.max_lba = lun_num_blocks() - 1;
     // Format capacity data
     udi_msc_capacity.block_len = CPU_TO_BE32(UDI_MSC_BLOCK_SIZE);
     udi_msc_capacity.max_lba = CPU_TO_BE32(udi_msc_capacity.max_lba);
@@ -707,8 +776,82 @@ static void udi_msc_sbc_read_capacity(void) {
 }
 
 __attribute__((__aligned__(4))) static uint8_t block_buffer[UDI_MSC_BLOCK_SIZE];
+// reads alternate between this and block_buffer, so one sector is built
+// while the previous one is still on the wire
+__attribute__((__aligned__(4))) static uint8_t read_ahead_buffer[UDI_MSC_BLOCK_SIZE];
 static WriteState usbWriteState;
 
+static uint8_t *read_buffer(uint32_t i) {
+    return i & 1 ? read_ahead_buffer : block_buffer;
+}
+
+// Queue a sector once the one before it has left; false if the bus was reset.
+static bool send_sector(uint8_t *buf) {
+    if (!USB_WriteWait(USB_EP_MSC_IN))
+        return false;
+    USB_WriteSubmit(buf, UDI_MSC_BLOCK_SIZE, USB_EP_MSC_IN);
+    return true;
+}
+
+#if USE_FLASH_LUN
+// READ10/WRITE10 on the raw SPI flash; block n lives at offset n * 512.
+static void udi_msc_flash_trans(bool b_read, uint32_t addr, uint16_t nb_block) {
+    uint32_t n = lun_num_blocks();
+    // the LBA comes straight from the CDB; addr + nb_block could wrap around
+    if (addr >= n || nb_block > n - addr) {
+        udi_msc_sense_fail(SCSI_SK_ILLEGAL_REQUEST, SCSI_ASC_INVALID_FIELD_IN_CDB, addr);
+        udi_msc_csw_process();
+        return;
+    }
+
+    uint32_t end = (addr + nb_block) * UDI_MSC_BLOCK_SIZE;
+
+    // reads must see everything written before; also, every command is its
+    // own erase session, as the host may rewrite the same blocks later
+    ext_flash_flush();
+
+    for (uint32_t i = 0; i < nb_block; ++i) {
+        if (!USB_Ok()) {
+            logmsg("Transfer aborted.");
+            ext_flash_flush();
+            return;
+        }
+
+        uint32_t offset = (addr + i) * UDI_MSC_BLOCK_SIZE;
+        if (b_read) {
+            uint8_t *buf = read_buffer(i);
+            ext_flash_read_sector(offset, buf);
+            if (!send_sector(buf)) {
+                logmsg("Transfer aborted.");
+                return;
+            }
+        } else {
+            if (USB_ReadMulti(block_buffer, UDI_MSC_BLOCK_SIZE, USB_EP_MSC_OUT) !=
+                UDI_MSC_BLOCK_SIZE) {
+                logmsg("Transfer aborted.");
+                ext_flash_flush();
+                return;
+            }
+            ext_flash_write_block(offset, block_buffer, end);
+            led_signal();
+        }
+        udi_msc_csw.dCSWDataResidue -= UDI_MSC_BLOCK_SIZE;
+    }
+
+    if (b_read) {
+        if (!USB_WriteWait(USB_EP_MSC_IN)) {
+            logmsg("Transfer aborted.");
+            return;
+        }
+    } else {
+        ext_flash_flush();
+    }
+
+    udi_msc_sense_pass();
+    udi_msc_csw_process();
+}
+#endif
+
 static void udi_msc_sbc_trans(bool b_read) {
     uint32_t trans_size;
 
@@ -739,6 +882,13 @@ static void udi_msc_sbc_trans(bool b_read) {
     logwrite("\n");
 #endif
 
+#if USE_FLASH_LUN
+    if (is_flash_lun()) {
+        udi_msc_flash_trans(b_read, udi_msc_addr, udi_msc_nb_block);
+        return;
+    }
+#endif
+
     for (uint32_t i = 0; i < udi_msc_nb_block; ++i) {
         if (!USB_Ok()) {
             logmsg("Transfer aborted.");
@@ -747,10 +897,18 @@ static void udi_msc_sbc_trans(bool b_read) {
 
         // logval("readblk", i);
         if (b_read) {
-            read_block(udi_msc_addr + i, block_buffer);
-            USB_Write(block_buffer, UDI_MSC_BLOCK_SIZE, USB_EP_MSC_IN);
+            uint8_t *buf = read_buffer(i);
+            read_block(udi_msc_addr + i, buf);
+            if (!send_sector(buf)) {
+                logmsg("Transfer aborted.");
+                return;
+            }
         } else {
-            USB_ReadBlocking(block_buffer, UDI_MSC_BLOCK_SIZE, USB_EP_MSC_OUT, 0);
+            if (USB_ReadMulti(block_buffer, UDI_MSC_BLOCK_SIZE, USB_EP_MSC_OUT) !=
+                UDI_MSC_BLOCK_SIZE) {
+                logmsg("Transfer aborted.");
+                return;
+            }
 
 #if 0
             check_uf2_handover(block_buffer, udi_msc_nb_block - i - 1, USB_EP_MSC_IN,
@@ -763,6 +921,11 @@ static void udi_msc_sbc_trans(bool b_read) {
         udi_msc_csw.dCSWDataResidue -= UDI_MSC_BLOCK_SIZE;
     }
 
+    if (b_read && !USB_WriteWait(USB_EP_MSC_IN)) {
+        logmsg("Transfer aborted.");
+        return;
+    }
+
     udi_msc_sense_pass();
 
     // Send status of transfer in CSW packet
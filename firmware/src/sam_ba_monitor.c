@@ -143,6 +143,14 @@ void sam_ba_monitor_run(void) {
         ptr = data;
         for (i = 0; i < length; i++) {
             if (*ptr != 0xff) {
+#if USE_SERPROG
+                if (serprog_is_command(*ptr)) {
+                    uint32_t n = serprog_command(ptr, length - i);
+                    ptr += n;
+                    i += n - 1;
+                    continue;
+                }
+#endif
                 if (*ptr == '#') {
 #if USE_CDC_TERMINAL
                     if (b_terminal_mode) {
@@ -265,6 +273,21 @@ void sam_ba_monitor_run(void) {
                         cdc_write_buf("Z", 1);
                         put_uint32(crc);
                         cdc_write_buf("#\n\r", 3);
+#ifdef BOARD_FLASH_CS_PIN
+                    } else if (command == 'Q') {
+                        // Same as Z, but CRC-32 over the external SPI flash,
+                        // computed by the DMAC while the flash is read.
+                        // Not a hex digit, and not used by SAM-BA or BOSSA.
+
+                        // Syntax: Q[FLASH_OFFSET],[SIZE]#
+                        // Returns: Q[CRC32]#
+
+                        uint32_t crc = ext_flash_crc32((uint32_t)ptr_data, current_number);
+
+                        cdc_write_buf("Q", 1);
+                        put_uint32(crc);
+                        cdc_write_buf("#\n\r", 3);
+#endif
                     }
 
                     command = 'z';
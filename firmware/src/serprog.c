@@ -0,0 +1,282 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * flashrom serprog protocol on the CDC port
+ *
+ * Command bytes below 0x20 (other than CR and LF) can't start a SAM-BA
+ * command, so sam_ba_monitor_run() hands them over to serprog_command().
+ * Only the SPI bus is offered; S_CMD_O_SPIOP runs one SPI transaction on
+ * the external flash pins.
+ *
+ * flashrom keeps up to SERPROG_SERBUF_SIZE bytes of commands in flight
+ * before it waits for their replies. The commands in a USB packet are
+ * executed back to back and their replies collected, so a whole batch
+ * costs a single round trip.
+ */
+
+#include "uf2.h"
+
+#if USE_SERPROG
+
+#define S_ACK 0x06
+#define S_NAK 0x15
+
+#define S_CMD_NOP 0x00
+#define S_CMD_Q_IFACE 0x01
+#define S_CMD_Q_CMDMAP 0x02
+#define S_CMD_Q_PGMNAME 0x03
+#define S_CMD_Q_SERBUF 0x04
+#define S_CMD_Q_BUSTYPE 0x05
+#define S_CMD_Q_OPBUF 0x07
+#define S_CMD_Q_WRNMAXLEN 0x08
+#define S_CMD_O_INIT 0x0B
+#define S_CMD_O_DELAY 0x0E
+#define S_CMD_O_EXEC 0x0F
+#define S_CMD_SYNCNOP 0x10
+#define S_CMD_Q_RDNMAXLEN 0x11
+#define S_CMD_S_BUSTYPE 0x12
+#define S_CMD_O_SPIOP 0x13
+#define S_CMD_S_SPI_FREQ 0x14
+#define S_CMD_S_PIN_STATE 0x15
+
+#define SERPROG_IFACE_VERSION 1
+#define SERPROG_BUS_SPI 0x08
+#define SERPROG_SERBUF_SIZE 4096
+// each queued delay takes 4 bytes
+#define SERPROG_OPBUF_SIZE 64
+
+#define CHUNK_SIZE 64
+
+static const uint32_t supported_commands =
+    (1 << S_CMD_NOP) | (1 << S_CMD_Q_IFACE) | (1 << S_CMD_Q_CMDMAP) | (1 << S_CMD_Q_PGMNAME) |
+    (1 << S_CMD_Q_SERBUF) | (1 << S_CMD_Q_BUSTYPE) | (1 << S_CMD_Q_OPBUF) |
+    (1 << S_CMD_Q_WRNMAXLEN) | (1 << S_CMD_O_INIT) | (1 << S_CMD_O_DELAY) |
+    (1 << S_CMD_O_EXEC) | (1 << S_CMD_SYNCNOP) | (1 << S_CMD_Q_RDNMAXLEN) |
+    (1 << S_CMD_S_BUSTYPE) | (1 << S_CMD_O_SPIOP) | (1 << S_CMD_S_SPI_FREQ) |
+    (1 << S_CMD_S_PIN_STATE);
+
+// Rest of the current USB packet
+static const uint8_t *input;
+static uint32_t input_len;
+
+__attribute__((__aligned__(4))) static uint8_t reply[256];
+static uint32_t reply_len;
+
+// Delays queued by S_CMD_O_DELAY, in microseconds
+static uint32_t opbuf[SERPROG_OPBUF_SIZE / 4];
+static uint32_t opbuf_len;
+
+static void flush_reply(void) {
+    if (reply_len)
+        cdc_write_buf(reply, reply_len);
+    reply_len = 0;
+}
+
+static uint8_t *reserve(uint32_t len) {
+    if (reply_len + len > sizeof(reply))
+        flush_reply();
+    uint8_t *p = reply + reply_len;
+    reply_len += len;
+    return p;
+}
+
+static void put(uint8_t b) {
+    *reserve(1) = b;
+}
+
+static void put_le(uint32_t v, int len) {
+    uint8_t *p = reserve(len);
+    for (int i = 0; i < len; ++i)
+        p[i] = v >> (8 * i);
+}
+
+static void get(uint8_t *dst, uint32_t len) {
+    uint32_t n = len < input_len ? len : input_len;
+    memcpy(dst, input, n);
+    input += n;
+    input_len -= n;
+    if (n < len) {
+        // the host may be waiting for replies before it sends more
+        flush_reply();
+        cdc_read_buf_xmd(dst + n, len - n);
+    }
+}
+
+static uint32_t get_le(int len) {
+    uint8_t buf[4];
+    uint32_t v = 0;
+    get(buf, len);
+    for (int i = len - 1; i >= 0; --i)
+        v = (v << 8) | buf[i];
+    return v;
+}
+
+static void delay_us(uint32_t us) {
+    for (uint32_t i = us * (CPU_FREQUENCY / 1000000) / 4; i; --i)
+        asm("nop");
+}
+
+static void spi_op(void) {
+    uint8_t buf[CHUNK_SIZE];
+    uint32_t slen = get_le(3);
+    uint32_t rlen = get_le(3);
+
+    // nothing of ours may be in flight, and the cache goes stale
+    ext_flash_flush();
+    ext_flash_invalidate_cache();
+
+    // a capture DMA may still be clocking the FPGA with its CS low
+    spi_m_dma_wait();
+    PINOP(BOARD_FLASH_CS_PIN, OUTCLR);
+    while (slen) {
+        uint32_t n = slen < CHUNK_SIZE ? slen : CHUNK_SIZE;
+        get(buf, n);
+        struct spi_xfer xfer = {buf, NULL, n};
+        spi_m_sync_transfer(&xfer);
+        slen -= n;
+    }
+    put(S_ACK);
+    while (rlen) {
+        uint32_t n = rlen < CHUNK_SIZE ? rlen : CHUNK_SIZE;
+        struct spi_xfer xfer = {NULL, reserve(n), n};
+        spi_m_sync_transfer(&xfer);
+        rlen -= n;
+    }
+    PINOP(BOARD_FLASH_CS_PIN, OUTSET);
+}
+
+bool serprog_is_command(uint8_t c) {
+    return c < 0x20 && c != '\r' && c != '\n';
+}
+
+uint32_t serprog_command(const uint8_t *buf, uint32_t length) {
+    uint8_t cmd = buf[0];
+    uint8_t *name;
+    uint32_t v;
+
+    input = buf + 1;
+    input_len = length - 1;
+
+    if (!(supported_commands & (1UL << cmd))) {
+        put(S_NAK);
+    } else
+        switch (cmd) {
+        case S_CMD_NOP:
+            put(S_ACK);
+            break;
+        case S_CMD_O_EXEC:
+            for (uint32_t i = 0; i < opbuf_len; ++i)
+                delay_us(opbuf[i]);
+            // fall through
+        case S_CMD_O_INIT:
+            opbuf_len = 0;
+            put(S_ACK);
+            break;
+        case S_CMD_Q_IFACE:
+            put(S_ACK);
+            put_le(SERPROG_IFACE_VERSION, 2);
+            break;
+        case S_CMD_Q_CMDMAP:
+            put(S_ACK);
+            put_le(supported_commands, 4);
+            memset(reserve(28), 0, 28);
+            break;
+        case S_CMD_Q_PGMNAME:
+            put(S_ACK);
+            name = reserve(16);
+            memset(name, 0, 16);
+            memcpy(name, "FPGA Helper", 11);
+            break;
+        case S_CMD_Q_SERBUF:
+            put(S_ACK);
+            put_le(SERPROG_SERBUF_SIZE, 2);
+            break;
+        case S_CMD_Q_BUSTYPE:
+            put(S_ACK);
+            put(SERPROG_BUS_SPI);
+            break;
+        case S_CMD_Q_OPBUF:
+            put(S_ACK);
+            put_le(SERPROG_OPBUF_SIZE, 2);
+            break;
+        case S_CMD_Q_WRNMAXLEN:
+        case S_CMD_Q_RDNMAXLEN:
+            // 0 is "as long as a SPI operation can be"; data is streamed in chunks
+            put(S_ACK);
+            put_le(0, 3);
+            break;
+        case S_CMD_O_DELAY:
+            v = get_le(4);
+            if (opbuf_len < SERPROG_OPBUF_SIZE / 4) {
+                opbuf[opbuf_len++] = v;
+                put(S_ACK);
+            } else {
+                put(S_NAK);
+            }
+            break;
+        case S_CMD_SYNCNOP:
+            put(S_NAK);
+            put(S_ACK);
+            break;
+        case S_CMD_S_BUSTYPE:
+            v = get_le(1);
+            put(v == SERPROG_BUS_SPI ? S_ACK : S_NAK);
+            break;
+        case S_CMD_O_SPIOP:
+            spi_op();
+            break;
+        case S_CMD_S_SPI_FREQ:
+            v = get_le(4);
+            if (v) {
+                put(S_ACK);
+                put_le(spi_m_sync_set_baudrate(v), 4);
+            } else {
+                put(S_NAK);
+            }
+            break;
+        case S_CMD_S_PIN_STATE:
+            // 0 leaves the bus to the FPGA, like fpga_boot_from_flash() does
+            if (get_le(1)) {
+                PINOP(BOARD_FLASH_CS_PIN, OUTSET);
+                PINOP(BOARD_FLASH_CS_PIN, DIRSET);
+                spi_m_sync_acquire();
+            } else {
+                ext_flash_flush();
+                spi_m_sync_release();
+                PINOP(BOARD_FLASH_CS_PIN, DIRCLR);
+            }
+            put(S_ACK);
+            break;
+        }
+
+    // reply once the packet has been worked through
+    if (!input_len)
+        flush_reply();
+
+    return length - input_len;
+}
+
+#endif
@@ -23,10 +23,286 @@
  */
 
 /*
- * Bit-banging SPI Driver
+ * SPI master driver for the external flash
  */
 
-uint8_t shift_spi_byte(uint8_t x) {
+#include "uf2.h"
+#include "spi_driver.h"
+
+#ifdef BOARD_FLASH_CS_PIN
+
+#ifdef BOARD_FLASH_SERCOM
+#include "uart_driver.h"
+
+// SERCOM baud generator in synchronous mode: f_sck = f_ref / (2 * (BAUD + 1))
+#define SPI_MAX_BAUDRATE (CPU_FREQUENCY / 2)
+
+static void spi_pinmux(uint32_t pinmux) {
+    /* Mask 6th bit in pin number to check whether it is greater than 32
+     * i.e., PORTB pin */
+    uint32_t port = (pinmux & 0x200000) >> 21;
+    uint8_t pin = pinmux >> 16;
+    PORT->Group[port].PINCFG[(pin - (port * 32))].bit.PMUXEN = 1;
+    PORT->Group[port].PMUX[(pin - (port * 32)) / 2].reg &= ~(0xF << (4 * (pin & 0x01u)));
+    PORT->Group[port].PMUX[(pin - (port * 32)) / 2].reg |= (pinmux & 0xFF) << (4 * (pin & 0x01u));
+}
+
+/*
+ * DMA support
+ *
+ * Two channels are used per transfer. The RX channel drains DATA into the
+ * receive buffer (or a dummy byte) and its completion marks the end of the
+ * transfer, as that is only reached once the last byte has been shifted
+ * out and back in. The TX channel feeds DATA from the transmit buffer (or a
+ * constant 0xFF). Each channel gets a second, linked descriptor for the
+ * data phase.
+ */
+#define SPI_DMA_RX_CH 0
+#define SPI_DMA_TX_CH 1
+#define SPI_DMA_NUM_CH 2
+
+__attribute__((__aligned__(16))) static DmacDescriptor dma_desc[SPI_DMA_NUM_CH];
+__attribute__((__aligned__(16))) static DmacDescriptor dma_writeback[SPI_DMA_NUM_CH];
+__attribute__((__aligned__(16))) static DmacDescriptor dma_link[SPI_DMA_NUM_CH];
+
+static const uint8_t dma_fill = 0xff;
+static uint8_t dma_discard;
+static volatile bool dma_busy;
+static spi_dma_callback_t dma_done;
+
+static void spi_m_dma_init(uint32_t inst) {
+    PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+    PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+
+    DMAC->CTRL.reg = 0;
+    DMAC->CTRL.reg = DMAC_CTRL_SWRST;
+    while (DMAC->CTRL.reg & DMAC_CTRL_SWRST)
+        ;
+    DMAC->BASEADDR.reg = (uint32_t)dma_desc;
+    DMAC->WRBADDR.reg = (uint32_t)dma_writeback;
+    DMAC->CTRL.reg = DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xf);
+
+    // SERCOMn triggers are RX = 1 + 2n, TX = 2 + 2n
+    DMAC->CHID.reg = SPI_DMA_RX_CH;
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+    DMAC->CHCTRLB.reg =
+        DMAC_CHCTRLB_TRIGSRC(SERCOM0_DMAC_ID_RX + inst * 2) | DMAC_CHCTRLB_TRIGACT_BEAT;
+    DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL;
+
+    DMAC->CHID.reg = SPI_DMA_TX_CH;
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+    DMAC->CHCTRLB.reg =
+        DMAC_CHCTRLB_TRIGSRC(SERCOM0_DMAC_ID_TX + inst * 2) | DMAC_CHCTRLB_TRIGACT_BEAT;
+
+    NVIC_EnableIRQ(DMAC_IRQn);
+}
+
+// Fill in a byte-wide descriptor. Incrementing addresses point at the end of
+// the block, as the DMAC expects.
+static void dma_setup(DmacDescriptor *desc, const struct spi_xfer *xfer, bool tx,
+                      DmacDescriptor *next) {
+    Sercom *sercom = BOARD_FLASH_SERCOM;
+    uint16_t btctrl = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE |
+                      (next ? DMAC_BTCTRL_BLOCKACT_NOACT : DMAC_BTCTRL_BLOCKACT_INT);
+
+    if (tx) {
+        if (xfer->txbuf) {
+            btctrl |= DMAC_BTCTRL_SRCINC;
+            desc->SRCADDR.reg = (uint32_t)xfer->txbuf + xfer->size;
+        } else {
+            desc->SRCADDR.reg = (uint32_t)&dma_fill;
+        }
+        desc->DSTADDR.reg = (uint32_t)&sercom->SPI.DATA.reg;
+    } else {
+        desc->SRCADDR.reg = (uint32_t)&sercom->SPI.DATA.reg;
+        if (xfer->rxbuf) {
+            btctrl |= DMAC_BTCTRL_DSTINC;
+            desc->DSTADDR.reg = (uint32_t)xfer->rxbuf + xfer->size;
+        } else {
+            desc->DSTADDR.reg = (uint32_t)&dma_discard;
+        }
+    }
+    desc->BTCTRL.reg = btctrl;
+    desc->BTCNT.reg = xfer->size;
+    desc->DESCADDR.reg = (uint32_t)next;
+}
+
+bool spi_m_dma_transfer(const struct spi_xfer *header, const struct spi_xfer *data,
+                        spi_dma_callback_t done) {
+    if (header->size > SPI_DMA_MAX_SIZE || (data && data->size > SPI_DMA_MAX_SIZE))
+        return false;
+    while (dma_busy)
+        ;
+
+    bool linked = data && data->size;
+    for (int ch = 0; ch < SPI_DMA_NUM_CH; ++ch) {
+        bool tx = ch == SPI_DMA_TX_CH;
+        if (linked) {
+            dma_setup(&dma_desc[ch], header, tx, &dma_link[ch]);
+            dma_setup(&dma_link[ch], data, tx, NULL);
+        } else {
+            dma_setup(&dma_desc[ch], header, tx, NULL);
+        }
+    }
+
+    dma_done = done;
+    dma_busy = true;
+
+    // start the receiver first, so no byte is missed
+    DMAC->CHID.reg = SPI_DMA_RX_CH;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_MASK;
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+    DMAC->CHID.reg = SPI_DMA_TX_CH;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_MASK;
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_ENABLE;
+    return true;
+}
+
+bool spi_m_dma_busy(void) { return dma_busy; }
+
+void spi_m_dma_wait(void) {
+    while (dma_busy)
+        ;
+}
+
+bool spi_m_dma_crc32_start(void) {
+    DMAC->CTRL.reg &= ~DMAC_CTRL_CRCENABLE;
+    DMAC->CRCCTRL.reg = DMAC_CRCCTRL_CRCBEATSIZE_BYTE | DMAC_CRCCTRL_CRCPOLY_CRC32 |
+                        DMAC_CRCCTRL_CRCSRC(0x20 + SPI_DMA_RX_CH);
+    DMAC->CRCCHKSUM.reg = 0xffffffff;
+    DMAC->CTRL.reg |= DMAC_CTRL_CRCENABLE;
+    return true;
+}
+
+uint32_t spi_m_dma_crc32_end(void) {
+    DMAC->CTRL.reg &= ~DMAC_CTRL_CRCENABLE;
+    // for CRC32 the checksum reads back bit reversed and complemented,
+    // i.e. it is the usual (zlib) CRC-32
+    return DMAC->CRCCHKSUM.reg;
+}
+
+void DMAC_Handler(void) {
+    DMAC->CHID.reg = SPI_DMA_RX_CH;
+    if (DMAC->CHINTFLAG.reg & DMAC_CHINTFLAG_TCMPL) {
+        DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL;
+        dma_busy = false;
+        if (dma_done)
+            dma_done();
+    }
+}
+
+static void spi_pin_release(uint32_t pinmux) {
+    uint32_t pin = pinmux >> 16;
+    PORT->Group[pin / 32].PINCFG[pin % 32].bit.PMUXEN = 0;
+    PINOP(pin, DIRCLR);
+}
+
+void spi_m_sync_release(void) {
+    spi_pin_release(BOARD_FLASH_MOSI_PINMUX);
+    spi_pin_release(BOARD_FLASH_SCK_PINMUX);
+}
+
+void spi_m_sync_acquire(void) {
+    spi_pinmux(BOARD_FLASH_MOSI_PINMUX);
+    spi_pinmux(BOARD_FLASH_SCK_PINMUX);
+}
+
+void spi_m_sync_init(void) {
+    Sercom *sercom = BOARD_FLASH_SERCOM;
+    uint32_t inst = uart_get_sercom_index(sercom);
+
+    spi_pinmux(BOARD_FLASH_MOSI_PINMUX);
+    spi_pinmux(BOARD_FLASH_MISO_PINMUX);
+    spi_pinmux(BOARD_FLASH_SCK_PINMUX);
+
+    /* Enable clock for the SERCOM */
+    PM->APBCMASK.reg |= (1u << (inst + PM_APBCMASK_SERCOM0_Pos));
+
+    /* Set GCLK_GEN0 as source for GCLK_ID_SERCOMx_CORE */
+    GCLK->CLKCTRL.reg =
+        GCLK_CLKCTRL_ID(inst + GCLK_ID_SERCOM0_CORE) | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+    while (GCLK->STATUS.bit.SYNCBUSY)
+        ;
+
+    /* Perform a software reset */
+    sercom->SPI.CTRLA.bit.SWRST = 1;
+    while (sercom->SPI.CTRLA.bit.SWRST || sercom->SPI.SYNCBUSY.bit.SWRST)
+        ;
+
+    /* SPI master, mode 0, MSB first */
+    sercom->SPI.CTRLA.reg = SERCOM_SPI_CTRLA_MODE_SPI_MASTER |
+                            SERCOM_SPI_CTRLA_DOPO(BOARD_FLASH_DOPO) |
+                            SERCOM_SPI_CTRLA_DIPO(BOARD_FLASH_DIPO);
+    /* Enable receive and set data size to 8 bits */
+    sercom->SPI.CTRLB.reg = SERCOM_SPI_CTRLB_RXEN | SERCOM_SPI_CTRLB_CHSIZE(0);
+    while (sercom->SPI.SYNCBUSY.bit.CTRLB)
+        ;
+
+    spi_m_sync_set_baudrate(BOARD_FLASH_BAUDRATE);
+
+    sercom->SPI.CTRLA.bit.ENABLE = 1;
+    while (sercom->SPI.SYNCBUSY.bit.ENABLE)
+        ;
+
+    spi_m_dma_init(inst);
+}
+
+uint32_t spi_m_sync_set_baudrate(uint32_t baudrate) {
+    Sercom *sercom = BOARD_FLASH_SERCOM;
+
+    if (baudrate > SPI_MAX_BAUDRATE)
+        baudrate = SPI_MAX_BAUDRATE;
+    // round the divider up, so we never exceed the requested rate
+    uint32_t baud = (CPU_FREQUENCY + 2 * baudrate - 1) / (2 * baudrate) - 1;
+    if (baud > 0xff)
+        baud = 0xff;
+
+    // BAUD is enable-protected; it is only written while the SERCOM is disabled
+    bool enabled = sercom->SPI.CTRLA.bit.ENABLE;
+    if (enabled) {
+        sercom->SPI.CTRLA.bit.ENABLE = 0;
+        while (sercom->SPI.SYNCBUSY.bit.ENABLE)
+            ;
+    }
+    sercom->SPI.BAUD.reg = baud;
+    if (enabled) {
+        sercom->SPI.CTRLA.bit.ENABLE = 1;
+        while (sercom->SPI.SYNCBUSY.bit.ENABLE)
+            ;
+    }
+
+    return CPU_FREQUENCY / (2 * (baud + 1));
+}
+
+int32_t spi_m_sync_transfer(const struct spi_xfer *xfer) {
+    Sercom *sercom = BOARD_FLASH_SERCOM;
+    const uint8_t *tx = xfer->txbuf;
+    uint8_t *rx = xfer->rxbuf;
+
+    // the bus belongs to the DMA until its transfer is done
+    while (dma_busy)
+        ;
+
+    for (uint32_t i = 0; i < xfer->size; i++) {
+        while (!(sercom->SPI.INTFLAG.reg & SERCOM_SPI_INTFLAG_DRE))
+            ;
+        sercom->SPI.DATA.reg = tx ? tx[i] : 0xff;
+        while (!(sercom->SPI.INTFLAG.reg & SERCOM_SPI_INTFLAG_RXC))
+            ;
+        uint8_t read_data = sercom->SPI.DATA.reg;
+        if (rx)
+            rx[i] = read_data;
+    }
+    return xfer->size;
+}
+
+#else
+
+/*
+ * Bit-banging fallback, for boards whose flash pins are not on a SERCOM
+ */
+
+static uint8_t shift_spi_byte(uint8_t x) {
     uint8_t y = 0;
     for (uint8_t i = 0x80; i != 0; i >>= 1) {
         if (x & i)
@@ -50,6 +326,50 @@ uint8_t shift_spi_byte(uint8_t x) {
     return y;
 }
 
+void spi_m_sync_init(void) {
+    PINOP(BOARD_FLASH_MOSI_PIN, DIRSET);
+    PINOP(BOARD_FLASH_MISO_PIN, DIRCLR);
+    PINOP(BOARD_FLASH_SCK_PIN, DIRSET);
+    PINOP(BOARD_FLASH_SCK_PIN, OUTCLR);
+}
+
+void spi_m_sync_release(void) {
+    PINOP(BOARD_FLASH_MOSI_PIN, DIRCLR);
+    PINOP(BOARD_FLASH_SCK_PIN, DIRCLR);
+}
+
+void spi_m_sync_acquire(void) {
+    PINOP(BOARD_FLASH_MOSI_PIN, DIRSET);
+    PINOP(BOARD_FLASH_SCK_PIN, DIRSET);
+}
+
+uint32_t spi_m_sync_set_baudrate(uint32_t baudrate) {
+    // the bit-banged clock runs as fast as the CPU lets it
+    return baudrate;
+}
+
+bool spi_m_dma_transfer(const struct spi_xfer *header, const struct spi_xfer *data,
+                        spi_dma_callback_t done) {
+    // same limit as with the DMAC, so callers behave the same on every board
+    if (header->size > SPI_DMA_MAX_SIZE || (data && data->size > SPI_DMA_MAX_SIZE))
+        return false;
+    // no DMA without a SERCOM; do it in the foreground
+    spi_m_sync_transfer(header);
+    if (data)
+        spi_m_sync_transfer(data);
+    if (done)
+        done();
+    return true;
+}
+
+bool spi_m_dma_busy(void) { return false; }
+
+void spi_m_dma_wait(void) {}
+
+bool spi_m_dma_crc32_start(void) { return false; }
+
+uint32_t spi_m_dma_crc32_end(void) { return 0; }
+
 int32_t spi_m_sync_transfer(const struct spi_xfer *xfer) {
 	int32_t     rc   = 0;
     uint8_t     read_data;
@@ -66,3 +386,7 @@ int32_t spi_m_sync_transfer(const struct spi_xfer *xfer) {
     }
 	return rc;
 }
+
+#endif
+
+#endif
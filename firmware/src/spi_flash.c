@@ -25,15 +25,40 @@
  */
 #include "uf2.h"
 #include "spi_flash_api.h"
-#include "spi_driver.h"
 
 #include <stdint.h>
 #include <string.h>
 
 #include "common_commands.h"
 
+#ifdef BOARD_FLASH_CS_PIN
+
+// Write in progress bit of the first status register
+#define STATUS_BUSY 0x01
+
+// Clock used until the part is identified; every device in devices.h can do this.
+#define PROBE_BAUDRATE 1000000
+
+// The longest start_up_time_us in devices.h.
+#define MAX_START_UP_TIME_US 10000
+
+static const external_flash_device possible_devices[] = {
+    AT25DF081A, GD25Q16C,  GD25Q64C,    S25FL064L,   S25FL116K, S25FL216K,
+    W25Q16FW,   W25Q16JV,  W25Q32BV,    W25Q64JV_IM, W25Q64JV_IQ, W25Q80DL,
+};
+
+// Filled in from SFDP for parts missing in the table above.
+static external_flash_device sfdp_device;
+static const external_flash_device *flash_device;
+
+// 0x03 works on every part; 0x0B needs a dummy byte after the address.
+static uint8_t read_command = CMD_READ_DATA;
+static uint8_t read_header_length = 4;
+
 // Enable the flash over SPI.
 static void flash_enable(void) {
+    // a register capture may still be clocking with its own CS low
+    spi_m_dma_wait();
     PINOP(BOARD_FLASH_CS_PIN, OUTCLR);
 }
 
@@ -42,9 +67,23 @@ static void flash_disable(void) {
     PINOP(BOARD_FLASH_CS_PIN, OUTSET);
 }
 
+static volatile bool async_busy;
+static spi_flash_callback_t async_done;
+static uint8_t async_request[5];
+__attribute__((__aligned__(4))) static uint8_t async_page[SPI_FLASH_PAGE_SIZE];
+
+bool spi_flash_async_busy(void) {
+    return async_busy;
+}
+
+void spi_flash_async_wait(void) {
+    while (async_busy)
+        ;
+}
 
 static bool transfer(uint8_t* command, uint32_t command_length, uint8_t* data_in, uint8_t* data_out, uint32_t data_length) {
     struct spi_xfer xfer = { command, NULL, command_length };
+    spi_flash_async_wait();
     flash_enable();
     int32_t status = spi_m_sync_transfer(&xfer);
     if (status >= 0 && !(data_in == NULL && data_out == NULL)) {
@@ -89,6 +128,7 @@ bool spi_flash_write_data(uint32_t address, uint8_t* data, uint32_t data_length)
     // Write the SPI flash write address into the bytes following the command byte.
     address_to_bytes(address, request + 1);
     struct spi_xfer xfer = { request, NULL, 4 };
+    spi_flash_async_wait();
     flash_enable();
     int32_t status = spi_m_sync_transfer(&xfer);
     if (status >= 0) {
@@ -100,10 +140,11 @@ bool spi_flash_write_data(uint32_t address, uint8_t* data, uint32_t data_length)
 }
 
 bool spi_flash_read_data(uint32_t address, uint8_t* data, uint32_t data_length) {
-    uint8_t request[4] = {CMD_READ_DATA, 0x00, 0x00, 0x00};
+    uint8_t request[5] = {read_command, 0x00, 0x00, 0x00, 0x00};
     // Write the SPI flash write address into the bytes following the command byte.
     address_to_bytes(address, request + 1);
-    struct spi_xfer xfer = { request, NULL, 4 };
+    struct spi_xfer xfer = { request, NULL, read_header_length };
+    spi_flash_async_wait();
     flash_enable();
     int32_t status = spi_m_sync_transfer(&xfer);
     if (status >= 0) {
@@ -114,14 +155,197 @@ bool spi_flash_read_data(uint32_t address, uint8_t* data, uint32_t data_length)
     return status >= 0;
 }
 
+bool spi_flash_is_busy(void) {
+    uint8_t status;
+    if (spi_flash_async_busy())
+        return true;
+    spi_flash_read_command(CMD_READ_STATUS, &status, 1);
+    return (status & STATUS_BUSY) != 0;
+}
+
+void spi_flash_wait_ready(void) {
+    while (spi_flash_is_busy())
+        ;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t length) {
+    while (length--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; ++i)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return crc;
+}
+
+uint32_t spi_flash_crc32(uint32_t address, uint32_t length) {
+    uint8_t request[5] = {read_command, 0x00, 0x00, 0x00, 0x00};
+    address_to_bytes(address, request + 1);
+    struct spi_xfer xfer = { request, NULL, read_header_length };
+    uint32_t crc;
+
+    spi_flash_async_wait();
+    flash_enable();
+    // a single read command streams the whole range
+    spi_m_sync_transfer(&xfer);
+    if (spi_m_dma_crc32_start()) {
+        while (length) {
+            uint32_t n = length > SPI_DMA_MAX_SIZE ? SPI_DMA_MAX_SIZE : length;
+            struct spi_xfer data = {NULL, NULL, n};
+            spi_m_dma_transfer(&data, NULL, NULL);
+            while (spi_m_dma_busy())
+                ;
+            length -= n;
+        }
+        crc = spi_m_dma_crc32_end();
+    } else {
+        uint8_t buf[64];
+        crc = 0xffffffff;
+        while (length) {
+            uint32_t n = length > sizeof(buf) ? sizeof(buf) : length;
+            struct spi_xfer data = {NULL, buf, n};
+            spi_m_sync_transfer(&data);
+            crc = crc32_update(crc, buf, n);
+            length -= n;
+        }
+        crc = ~crc;
+    }
+    flash_disable();
+    return crc;
+}
+
+// Called from the DMAC interrupt at the end of an asynchronous transfer.
+static void async_complete(void) {
+    flash_disable();
+    async_busy = false;
+    if (async_done)
+        async_done();
+}
+
+static bool transfer_async(uint8_t command, uint32_t header_length, uint32_t address, uint8_t* data_in, uint8_t* data_out, uint32_t data_length, spi_flash_callback_t done) {
+    // a single DMA transfer; longer reads have to be split by the caller
+    if (data_length > SPI_DMA_MAX_SIZE)
+        return false;
+    spi_flash_async_wait();
+    async_request[0] = command;
+    address_to_bytes(address, async_request + 1);
+    async_request[4] = 0x00; // dummy byte of fast read
+    struct spi_xfer header = {async_request, NULL, header_length};
+    struct spi_xfer data = {data_in, data_out, data_length};
+    async_done = done;
+    async_busy = true;
+    flash_enable();
+    spi_m_dma_transfer(&header, &data, async_complete);
+    return true;
+}
+
+bool spi_flash_write_data_async(uint32_t address, uint8_t* data, uint32_t data_length, spi_flash_callback_t done) {
+    if (data_length > SPI_FLASH_PAGE_SIZE)
+        return false;
+    // the previous page may still be going out of async_page
+    spi_flash_async_wait();
+    memcpy(async_page, data, data_length);
+    return transfer_async(CMD_PAGE_PROGRAM, 4, address, async_page, NULL, data_length, done);
+}
+
+bool spi_flash_read_data_async(uint32_t address, uint8_t* data, uint32_t data_length, spi_flash_callback_t done) {
+    return transfer_async(read_command, read_header_length, address, NULL, data, data_length, done);
+}
+
 void spi_flash_init(void) {
-    PINOP(BOARD_FLASH_MOSI_PIN, DIRSET);
-    PINOP(BOARD_FLASH_MISO_PIN, DIRCLR);
-    PINOP(BOARD_FLASH_SCK_PIN, DIRSET);
     PINOP(BOARD_FLASH_CS_PIN, DIRSET);
     flash_disable();
+    spi_m_sync_init();
+    if (BOARD_FLASH_BAUDRATE > PROBE_BAUDRATE)
+        spi_m_sync_set_baudrate(PROBE_BAUDRATE);
+}
+
+// Read from the SFDP area (0x5A, three address bytes and a dummy byte).
+static bool read_sfdp(uint32_t address, uint8_t* data, uint32_t data_length) {
+    uint8_t request[5] = {CMD_READ_SFDP, 0x00, 0x00, 0x00, 0x00};
+    address_to_bytes(address, request + 1);
+    return transfer(request, 5, NULL, data, data_length);
+}
+
+// Build a descriptor from the JEDEC basic flash parameter table (JESD216).
+static const external_flash_device* sfdp_detect(const uint8_t* jedec_id) {
+    uint8_t header[16];
+    uint32_t bfpt[2];
+
+    if (!read_sfdp(0, header, sizeof(header)) || memcmp(header, "SFDP", 4))
+        return NULL;
+    // the first parameter header is always the basic flash parameter table
+    uint32_t table = header[12] | (header[13] << 8) | (header[14] << 16);
+    if (!read_sfdp(table, (uint8_t*)bfpt, sizeof(bfpt)))
+        return NULL;
+
+    // we only ever erase 4K sectors with 0x20
+    if ((bfpt[0] & 0x3) != 0x1 || ((bfpt[0] >> 8) & 0xff) != CMD_SECTOR_ERASE)
+        return NULL;
+
+    // density in bits; either size - 1 or a power of two
+    uint32_t density = bfpt[1];
+    if (density & 0x80000000)
+        sfdp_device.total_size = 1 << ((density & 0x7fffffff) - 3);
+    else
+        sfdp_device.total_size = (density + 1) / 8;
+
+    sfdp_device.manufacturer_id = jedec_id[0];
+    sfdp_device.memory_type = jedec_id[1];
+    sfdp_device.capacity = jedec_id[2];
+    // SFDP doesn't tell the clock; stay at the rate the probe ran with
+    sfdp_device.max_clock_speed_mhz = PROBE_BAUDRATE / 1000000;
+    // 0x0B is mandatory on anything new enough to have SFDP
+    sfdp_device.supports_fast_read = true;
+    return &sfdp_device;
+}
+
+const external_flash_device* spi_flash_detect(void) {
+    uint8_t jedec_id[3];
+
+    // The response will be 0xff if the flash needs more time to start up.
+    uint32_t start = sysTicks;
+    for (;;) {
+        spi_flash_read_command(CMD_READ_JEDEC_ID, jedec_id, 3);
+        if (jedec_id[0] != 0xff ||
+            sysTicks - start > MAX_START_UP_TIME_US * (SYSTICK_HZ / 1000) / 1000)
+            break;
+    }
+
+    for (uint32_t i = 0; i < sizeof(possible_devices) / sizeof(possible_devices[0]); ++i) {
+        const external_flash_device* d = &possible_devices[i];
+        if (d->manufacturer_id == jedec_id[0] && d->memory_type == jedec_id[1] &&
+            d->capacity == jedec_id[2])
+            return d;
+    }
+
+    if (jedec_id[0] == 0xff || jedec_id[0] == 0x00)
+        return NULL;
+
+    return sfdp_detect(jedec_id);
 }
 
 void spi_flash_init_device(const external_flash_device* device) {
+    flash_device = device;
+    if (!device)
+        return; // unknown part, keep the probe settings
 
+    uint32_t baudrate = BOARD_FLASH_BAUDRATE;
+    if (baudrate > device->max_clock_speed_mhz * 1000000)
+        baudrate = device->max_clock_speed_mhz * 1000000;
+    spi_m_sync_set_baudrate(baudrate);
+
+    if (device->supports_fast_read) {
+        read_command = CMD_FAST_READ;
+        read_header_length = 5;
+    }
+}
+
+const external_flash_device* spi_flash_device(void) {
+    return flash_device;
 }
+
+uint32_t spi_flash_size(void) {
+    return flash_device ? flash_device->total_size : 0;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * USB traffic counters and SCSI command timing, for STATS.TXT and
+ * HF2_CMD_USB_STATS
+ */
+
+#include "uf2.h"
+
+#if USE_USB_STATS
+
+#include "lib/usb_msc/sbc_protocol.h"
+#include "lib/usb_msc/spc_protocol.h"
+
+USB_Stats usb_stats;
+
+// the last entry takes every opcode not listed before it
+static SCSI_Stats scsi_stats = {
+    .num_opcodes = SCSI_STATS_OPCODES,
+    .opcodes =
+        {
+            {.opcode = SBC_READ10},
+            {.opcode = SBC_WRITE10},
+            {.opcode = SPC_TEST_UNIT_READY},
+            {.opcode = SPC_INQUIRY},
+            {.opcode = SPC_REQUEST_SENSE},
+            {.opcode = SCSI_STATS_OTHER},
+        },
+};
+
+// it has to fit in the one cluster of STATS.TXT
+char usbStatsFile[512];
+
+void usb_stats_get(USB_Stats *st) {
+    *st = usb_stats;
+#ifdef BOARD_FLASH_CS_PIN
+    st->flash_cache_hits = ext_flash_cache_hits;
+    st->flash_cache_misses = ext_flash_cache_misses;
+#endif
+}
+
+void scsi_stats_record(uint8_t opcode, uint32_t start) {
+    uint32_t us = (cpu_cycles() - start) / (CPU_FREQUENCY / 1000000);
+    SCSI_OpcodeStats *op = scsi_stats.opcodes;
+
+    while (op->opcode != opcode && op->opcode != SCSI_STATS_OTHER)
+        op++;
+
+    if (!op->count || us < op->min_us)
+        op->min_us = us;
+    if (us > op->max_us)
+        op->max_us = us;
+    op->count++;
+    op->total_us += us;
+
+    int b = 0;
+    while (b < SCSI_LATENCY_BUCKETS - 1 && us >= (64U << (2 * b)))
+        b++;
+    op->histogram[b]++;
+}
+
+void scsi_stats_get(SCSI_Stats *st) {
+    *st = scsi_stats;
+}
+
+static char *append(char *p, const char *str) {
+    while (*str && p < usbStatsFile + sizeof(usbStatsFile) - 3)
+        *p++ = *str++;
+    return p;
+}
+
+static char *append_hex(char *p, const char *label, uint32_t n) {
+    char num[9];
+    num[writeNum(num, n, false)] = 0;
+    p = append(p, label);
+    p = append(p, "0x");
+    return append(p, num);
+}
+
+// The file keeps its size, as the host may have listed the directory long
+// before it reads the contents: the text is padded with spaces.
+void usb_stats_update_file(void) {
+    USB_Stats st;
+    char *p = usbStatsFile;
+
+    usb_stats_get(&st);
+    p = append_hex(p, "USB resets ", st.resets);
+    p = append_hex(p, " setups ", st.setups);
+    p = append(p, "\r\n");
+
+    for (int i = 0; i < MAX_EP; ++i) {
+        USB_EndpointStats *ep = &st.ep[i];
+        if (!ep->rx_packets && !ep->tx_packets && !ep->stalls)
+            continue;
+        p = append_hex(p, "EP", i);
+        p = append_hex(p, " rx ", ep->rx_bytes);
+        p = append_hex(p, "/", ep->rx_packets);
+        p = append_hex(p, " tx ", ep->tx_bytes);
+        p = append_hex(p, "/", ep->tx_packets);
+        p = append_hex(p, " wait us ", ep->wait_us);
+        if (ep->stalls)
+            p = append_hex(p, " stalls ", ep->stalls);
+        p = append(p, "\r\n");
+    }
+
+#ifdef BOARD_FLASH_CS_PIN
+    p = append_hex(p, "Flash cache hits ", st.flash_cache_hits);
+    p = append_hex(p, " misses ", st.flash_cache_misses);
+    p = append(p, "\r\n");
+#endif
+
+    // the histograms are in HF2_CMD_USB_STATS
+    for (int i = 0; i < SCSI_STATS_OPCODES; ++i) {
+        SCSI_OpcodeStats *op = &scsi_stats.opcodes[i];
+        if (!op->count)
+            continue;
+        if (op->opcode == SCSI_STATS_OTHER)
+            p = append(p, "SCSI other");
+        else
+            p = append_hex(p, "SCSI ", op->opcode);
+        p = append_hex(p, ": n ", op->count);
+        p = append_hex(p, " us min ", op->min_us);
+        p = append_hex(p, " max ", op->max_us);
+        p = append_hex(p, " avg ", op->total_us / op->count);
+        p = append(p, "\r\n");
+    }
+
+    while (p < usbStatsFile + sizeof(usbStatsFile) - 3)
+        *p++ = ' ';
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = 0;
+}
+
+#endif
@@ -18,9 +18,11 @@ void delay(uint32_t ms) {
     }
 }
 
+// Runs from SysTick; under a handover the application owns the vector table,
+// so the USB polling loop calls it instead
 void timerTick(void) {
     if (timerLow-- == 0) {
-        timerLow = TIMER_STEP;
+        timerLow = (SCB->ICSR & SCB_ICSR_VECTACTIVE_Msk) ? TIMER_TICKS : TIMER_STEP;
         timerHigh++;
         if (resetHorizon && timerHigh >= resetHorizon) {
             resetHorizon = 0;
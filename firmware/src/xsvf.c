@@ -0,0 +1,356 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2018 Steiert Solutions
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * XSVF player (Xilinx XAPP503), driving the JTAG TAP in jtag.c
+ *
+ * The file is fed in arbitrary pieces, from UF2 blocks of the
+ * JTAG_XSVF_FAMILY_ID family or from the FPGA register interface. Each
+ * instruction is collected, then executed, so no host round trip is needed
+ * per TAP state change. XSVF vectors shift their last byte first, which is
+ * why scans are limited to XSVF_MAX_VECTOR_BYTES; longer ones have to be
+ * split with XSDRB/XSDRC/XSDRE.
+ */
+
+#include "uf2.h"
+
+#ifdef BOARD_JTAG_TCK_PIN
+
+#define XCOMPLETE 0x00
+#define XTDOMASK 0x01
+#define XSIR 0x02
+#define XSDR 0x03
+#define XRUNTEST 0x04
+#define XREPEAT 0x07
+#define XSDRSIZE 0x08
+#define XSDRTDO 0x09
+#define XSDRB 0x0C
+#define XSDRC 0x0D
+#define XSDRE 0x0E
+#define XSDRTDOB 0x0F
+#define XSDRTDOC 0x10
+#define XSDRTDOE 0x11
+#define XSTATE 0x12
+#define XENDIR 0x13
+#define XENDDR 0x14
+#define XSIR2 0x15
+#define XCOMMENT 0x16
+#define XWAIT 0x17
+
+#define DEFAULT_REPEAT 32
+
+// an instruction, with up to two vectors
+static uint8_t insn[1 + 2 * XSVF_MAX_VECTOR_BYTES];
+static uint32_t insn_len;
+static bool in_comment;
+
+static uint8_t tdo_mask[XSVF_MAX_VECTOR_BYTES];
+static uint8_t tdo_expected[XSVF_MAX_VECTOR_BYTES];
+static uint8_t tdo_captured[XSVF_MAX_VECTOR_BYTES];
+
+static uint32_t sdr_bits, runtest_us, num_insns;
+static uint8_t repeat, end_ir, end_dr;
+static uint8_t result = XSVF_IDLE;
+static uint32_t next_block;
+
+char jtagStatusFile[64] = "JTAG: idle\r\n";
+
+static void set_result(uint8_t r, const char *msg) {
+    char *p = jtagStatusFile;
+    result = r;
+    while (*msg)
+        *p++ = *msg++;
+    if (r != XSVF_RUNNING) {
+        p += strlen(strcpy(p, " after instruction "));
+        p += writeNum(p, num_insns, false);
+    }
+    strcpy(p, "\r\n");
+    if (r != XSVF_RUNNING)
+        jtag_end();
+}
+
+static uint32_t be32(const uint8_t *p) {
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t nbytes(uint32_t bits) {
+    return (bits + 7) / 8;
+}
+
+// XSVF vectors are big endian numbers; jtag_shift() wants bit 0 in the first byte.
+static uint8_t *lsb_first(uint8_t *dst, const uint8_t *src, uint32_t len) {
+    for (uint32_t i = 0; i < len; ++i)
+        dst[i] = src[len - 1 - i];
+    return dst;
+}
+
+static void reverse(uint8_t *p, uint32_t len) {
+    for (uint32_t i = 0; i < len / 2; ++i) {
+        uint8_t t = p[i];
+        p[i] = p[len - 1 - i];
+        p[len - 1 - i] = t;
+    }
+}
+
+// Total length of the instruction in insn[], 0 if unknown so far.
+static uint32_t insn_size(void) {
+    uint32_t sdr = nbytes(sdr_bits);
+
+    switch (insn[0]) {
+    case XCOMPLETE:
+        return 1;
+    case XTDOMASK:
+    case XSDR:
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+        return 1 + sdr;
+    case XSDRTDO:
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE:
+        return 1 + 2 * sdr;
+    case XSIR:
+        return insn_len < 2 ? 0 : 2 + nbytes(insn[1]);
+    case XSIR2:
+        return insn_len < 3 ? 0 : 3 + nbytes((insn[1] << 8) | insn[2]);
+    case XRUNTEST:
+    case XSDRSIZE:
+        return 5;
+    case XREPEAT:
+    case XSTATE:
+    case XENDIR:
+    case XENDDR:
+        return 2;
+    case XWAIT:
+        return 7;
+    default:
+        return 0xffffffff;
+    }
+}
+
+static bool tdo_matches(void) {
+    for (uint32_t i = 0; i < nbytes(sdr_bits); ++i)
+        if ((tdo_captured[i] ^ tdo_expected[i]) & tdo_mask[i])
+            return false;
+    return true;
+}
+
+// XSVF counts microseconds, and the clock may run faster than 1 MHz: give at
+// least one clock per microsecond, then keep clocking until the time is up.
+static void wait_us(uint32_t us) {
+    while (us) {
+        // cpu_cycles() wraps after about 89 s
+        uint32_t n = us < 10000000 ? us : 10000000;
+        uint32_t start = cpu_cycles();
+        jtag_idle(n);
+        while (cpu_cycles() - start < n * (CPU_FREQUENCY / 1000000))
+            jtag_idle(8);
+        us -= n;
+    }
+}
+
+static void shift_ir(uint8_t *tdi, uint32_t bits) {
+    reverse(tdi, nbytes(bits));
+    jtag_goto(JTAG_SHIFT_IR);
+    jtag_shift(tdi, NULL, bits, true);
+    jtag_goto(end_ir);
+    if (runtest_us)
+        wait_us(runtest_us);
+}
+
+// XSDR and XSDRTDO: retry with more run-test time while TDO doesn't match.
+static bool shift_dr(uint8_t *tdi) {
+    uint32_t wait = runtest_us;
+
+    reverse(tdi, nbytes(sdr_bits));
+    for (int tries = 0;; ++tries) {
+        jtag_goto(JTAG_SHIFT_DR);
+        jtag_shift(tdi, tdo_captured, sdr_bits, true);
+        if (tdo_matches())
+            break;
+        if (tries >= repeat)
+            return false;
+        // XAPP503 exception handling: back through Pause-DR and Update-DR to
+        // Run-Test/Idle, and wait 25% longer than the last time before retrying
+        jtag_goto(JTAG_PAUSE_DR);
+        jtag_goto(JTAG_SHIFT_DR);
+        jtag_goto(JTAG_IDLE);
+        wait += wait >> 2;
+        if (wait)
+            wait_us(wait);
+    }
+    jtag_goto(end_dr);
+    if (wait)
+        wait_us(wait);
+    return true;
+}
+
+// XSDRB/C/E and their TDO versions: a long scan in pieces.
+static bool shift_dr_part(uint8_t op, uint8_t *tdi, bool compare) {
+    bool last = op == XSDRE || op == XSDRTDOE;
+
+    if (op == XSDRB || op == XSDRTDOB)
+        jtag_goto(JTAG_SHIFT_DR);
+    reverse(tdi, nbytes(sdr_bits));
+    jtag_shift(tdi, tdo_captured, sdr_bits, last);
+    if (last) {
+        jtag_goto(end_dr);
+        if (runtest_us)
+            wait_us(runtest_us);
+    }
+    return !compare || tdo_matches();
+}
+
+static void execute(void) {
+    uint8_t op = insn[0];
+    uint32_t sdr = nbytes(sdr_bits);
+    bool ok = true;
+
+    num_insns++;
+    switch (op) {
+    case XCOMPLETE:
+        set_result(XSVF_DONE, "JTAG: XSVF done");
+        return;
+    case XTDOMASK:
+        lsb_first(tdo_mask, insn + 1, sdr);
+        break;
+    case XSIR:
+        shift_ir(insn + 2, insn[1]);
+        break;
+    case XSIR2:
+        shift_ir(insn + 3, (insn[1] << 8) | insn[2]);
+        break;
+    case XSDRTDO:
+        lsb_first(tdo_expected, insn + 1 + sdr, sdr);
+        // fall through
+    case XSDR:
+        ok = shift_dr(insn + 1);
+        break;
+    case XSDRTDOB:
+    case XSDRTDOC:
+    case XSDRTDOE:
+        lsb_first(tdo_expected, insn + 1 + sdr, sdr);
+        ok = shift_dr_part(op, insn + 1, true);
+        break;
+    case XSDRB:
+    case XSDRC:
+    case XSDRE:
+        shift_dr_part(op, insn + 1, false);
+        break;
+    case XRUNTEST:
+        runtest_us = be32(insn + 1);
+        break;
+    case XREPEAT:
+        repeat = insn[1];
+        break;
+    case XSDRSIZE:
+        sdr_bits = be32(insn + 1);
+        if (nbytes(sdr_bits) > XSVF_MAX_VECTOR_BYTES) {
+            set_result(XSVF_ERR_UNSUPPORTED, "JTAG: XSDRSIZE too large");
+            return;
+        }
+        break;
+    case XSTATE:
+        if (insn[1] == JTAG_RESET)
+            jtag_reset();
+        else
+            jtag_goto(insn[1] & 0xf);
+        break;
+    case XENDIR:
+        end_ir = insn[1] ? JTAG_PAUSE_IR : JTAG_IDLE;
+        break;
+    case XENDDR:
+        end_dr = insn[1] ? JTAG_PAUSE_DR : JTAG_IDLE;
+        break;
+    case XWAIT:
+        jtag_goto(insn[1] & 0xf);
+        wait_us(be32(insn + 3));
+        jtag_goto(insn[2] & 0xf);
+        break;
+    }
+
+    if (!ok)
+        set_result(XSVF_ERR_TDO_MISMATCH, "JTAG: TDO mismatch");
+}
+
+void xsvf_begin(void) {
+    insn_len = 0;
+    in_comment = false;
+    sdr_bits = runtest_us = num_insns = 0;
+    repeat = DEFAULT_REPEAT;
+    end_ir = end_dr = JTAG_IDLE;
+    memset(tdo_mask, 0, sizeof(tdo_mask));
+    jtag_begin();
+    set_result(XSVF_RUNNING, "JTAG: playing XSVF");
+}
+
+void xsvf_write(const uint8_t *data, uint32_t len) {
+    while (len-- && result == XSVF_RUNNING) {
+        uint8_t b = *data++;
+
+        if (in_comment) {
+            in_comment = b != 0;
+            continue;
+        }
+        if (insn_len == 0 && b == XCOMMENT) {
+            in_comment = true;
+            continue;
+        }
+
+        insn[insn_len++] = b;
+        uint32_t size = insn_size();
+        if (size > sizeof(insn)) {
+            set_result(XSVF_ERR_UNSUPPORTED, "JTAG: unsupported XSVF instruction");
+        } else if (size == insn_len) {
+            execute();
+            insn_len = 0;
+        }
+    }
+}
+
+uint8_t xsvf_result(void) {
+    return result;
+}
+
+bool xsvf_begin_block(UF2_Block *bl) {
+    if (bl->blockNo == 0) {
+        xsvf_begin();
+        next_block = 0;
+    } else if (bl->blockNo != next_block) {
+        if (result == XSVF_RUNNING)
+            set_result(XSVF_ERR_ORDER, "JTAG: block out of order");
+        return false;
+    }
+    next_block++;
+    return result == XSVF_RUNNING;
+}
+
+void xsvf_end_block(UF2_Block *bl) {
+    if (next_block >= bl->numBlocks && result == XSVF_RUNNING)
+        set_result(XSVF_ERR_TRUNCATED, "JTAG: XSVF ended without XCOMPLETE");
+}
+
+#endif